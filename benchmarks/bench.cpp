@@ -0,0 +1,401 @@
+#include "benchmark/benchmark.h"
+#include "../huffman-lib/huffman.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+std::string random_string(size_t length, char min, char max) {
+  std::default_random_engine eng(42);
+  std::uniform_int_distribution<char> random_char(min, max);
+  std::string s;
+  for (size_t i = 0; i < length; i++) {
+    s.push_back(random_char(eng));
+  }
+  return s;
+}
+
+constexpr size_t CORPUS_SIZE = size_t{16} << 20;
+constexpr size_t MESSAGE_SIZE = size_t{1} << 10;
+
+enum corpus : int64_t { uniform, single_byte, text, zipf, executable };
+
+// values with probability proportional to 1 / rank
+template <typename Eng>
+size_t zipf_rank(Eng& eng, std::vector<double> const& cumulative) {
+  double x = std::uniform_real_distribution<double>(0, cumulative.back())(eng);
+  return std::lower_bound(cumulative.begin(), cumulative.end(), x) - cumulative.begin();
+}
+
+std::vector<double> zipf_cumulative(size_t n) {
+  std::vector<double> cumulative;
+  double sum = 0;
+  for (size_t i = 1; i <= n; i++) {
+    sum += 1.0 / i;
+    cumulative.push_back(sum);
+  }
+  return cumulative;
+}
+
+// words of english letter frequencies, picked by zipf distribution and
+// joined into sentences
+std::string text_string(size_t length) {
+  std::default_random_engine eng(42);
+  std::string const letters = "etaoinshrdlcumwfgypbvkjxqz";
+  std::vector<double> letter_weights = zipf_cumulative(letters.size());
+  std::vector<std::string> words;
+  for (size_t i = 0; i < 5000; i++) {
+    size_t word_length = std::uniform_int_distribution<size_t>(1, 10)(eng);
+    std::string word;
+    for (size_t j = 0; j < word_length; j++) {
+      word.push_back(letters[zipf_rank(eng, letter_weights)]);
+    }
+    words.push_back(word);
+  }
+  std::vector<double> word_weights = zipf_cumulative(words.size());
+  std::string s;
+  size_t sentence = 0;
+  while (s.size() < length) {
+    std::string word = words[zipf_rank(eng, word_weights)];
+    if (sentence++ == 0) {
+      word[0] = static_cast<char>(word[0] - 'a' + 'A');
+    }
+    s += word;
+    if (sentence > 12 && std::uniform_int_distribution<int>(0, 9)(eng) == 0) {
+      s += ".\n";
+      sentence = 0;
+    } else {
+      s += ' ';
+    }
+  }
+  s.resize(length);
+  return s;
+}
+
+std::string zipf_string(size_t length) {
+  std::default_random_engine eng(42);
+  std::vector<double> weights = zipf_cumulative(256);
+  std::string s;
+  for (size_t i = 0; i < length; i++) {
+    s.push_back(static_cast<char>(zipf_rank(eng, weights)));
+  }
+  return s;
+}
+
+// the benchmark binary itself, repeated up to length
+std::string executable_string(size_t length) {
+  std::ifstream file("/proc/self/exe", std::ios::binary);
+  std::string exe{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  std::string s;
+  while (!exe.empty() && s.size() < length) {
+    s += exe;
+  }
+  s.resize(std::min(s.size(), length));
+  return s;
+}
+
+std::string make_corpus(int64_t c, size_t length) {
+  switch (c) {
+  case uniform:
+    return random_string(length, std::numeric_limits<char>::min(),
+                         std::numeric_limits<char>::max());
+  case single_byte:
+    return std::string(length, 'a');
+  case text:
+    return text_string(length);
+  case zipf:
+    return zipf_string(length);
+  default:
+    return executable_string(length);
+  }
+}
+
+// corpora are generated once for all the benchmarks
+std::string const& corpus_data(int64_t c) {
+  static std::map<int64_t, std::string> cache;
+  auto it = cache.find(c);
+  if (it == cache.end()) {
+    it = cache.emplace(c, make_corpus(c, CORPUS_SIZE)).first;
+  }
+  return it->second;
+}
+
+uint8_t const* bytes(std::string const& s) {
+  return reinterpret_cast<uint8_t const*>(s.data());
+}
+
+// range(0) is the corpus, range(1) is 1 for interleaved blocks
+huffman::encode_options corpus_options(benchmark::State& state) {
+  huffman::encode_options options;
+  options.interleaved = state.range(1) != 0;
+  return options;
+}
+
+void encode(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  huffman::encode_options options = corpus_options(state);
+  std::vector<uint8_t> dst(huffman::max_compressed_size(s.size(), options));
+  size_t size = 0;
+  for (auto _ : state) {
+    size = huffman::encode(bytes(s), s.size(), dst.data(), dst.size(), options);
+    benchmark::DoNotOptimize(dst.data());
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+  state.counters["ratio"] = static_cast<double>(s.size()) / size;
+}
+
+// range(1) is the sample fraction in thousandths; ratio and size cost are
+// against exact counts. Time to first byte is the shortest of a few runs
+// of the encoder class, which outputs a block as soon as it's full.
+void encode_sampled(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  huffman::encode_options options;
+  std::vector<uint8_t> dst(huffman::max_compressed_size(s.size(), options));
+  size_t exact = huffman::encode(bytes(s), s.size(), dst.data(), dst.size(), options);
+  options.sample_fraction = state.range(1) / 1000.0;
+  size_t size = 0;
+  for (auto _ : state) {
+    size = huffman::encode(bytes(s), s.size(), dst.data(), dst.size(), options);
+    benchmark::DoNotOptimize(dst.data());
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+  state.counters["ratio"] = static_cast<double>(s.size()) / size;
+  state.counters["size_cost"] = static_cast<double>(size) / exact - 1;
+  std::chrono::duration<double> first_byte = std::chrono::hours(1);
+  std::vector<uint8_t> stream;
+  for (size_t i = 0; i < 5; i++) {
+    huffman::encoder encoder(options);
+    stream.clear();
+    auto start = std::chrono::steady_clock::now();
+    encoder.feed(bytes(s), options.block_size, stream);
+    first_byte = std::min<std::chrono::duration<double>>(
+        first_byte, std::chrono::steady_clock::now() - start);
+  }
+  state.counters["first_byte"] = first_byte.count();
+}
+
+// pieces of text, zipf distributed bytes and the executable of 64 KiB up to
+// 1 MiB, whose statistics change at every piece
+std::string const& drifting_corpus() {
+  static std::string s = [] {
+    std::default_random_engine eng(42);
+    std::string result;
+    for (size_t i = 0; result.size() < CORPUS_SIZE; i++) {
+      std::string const& c = corpus_data(std::array<int64_t, 3>{text, zipf, executable}[i % 3]);
+      size_t length = std::uniform_int_distribution<size_t>(1, 16)(eng) << 16;
+      size_t start = std::uniform_int_distribution<size_t>(0, c.size() - length)(eng);
+      result.append(c, start, length);
+    }
+    result.resize(CORPUS_SIZE);
+    return result;
+  }();
+  return s;
+}
+
+// range(0) is 0 for fixed 1 MiB blocks, 1 for fixed 64 KiB blocks and
+// 2 for adaptive blocks up to 16 MiB
+void encode_drifting(benchmark::State& state) {
+  std::string const& s = drifting_corpus();
+  huffman::encode_options options;
+  options.block_size = state.range(0) == 1   ? huffman::MIN_BLOCK_SIZE
+                       : state.range(0) == 2 ? huffman::MAX_BLOCK_SIZE
+                                             : huffman::DEFAULT_BLOCK_SIZE;
+  options.adaptive = state.range(0) == 2;
+  std::vector<uint8_t> dst(huffman::max_compressed_size(s.size(), options));
+  size_t size = 0;
+  for (auto _ : state) {
+    size = huffman::encode(bytes(s), s.size(), dst.data(), dst.size(), options);
+    benchmark::DoNotOptimize(dst.data());
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+  state.counters["ratio"] = static_cast<double>(s.size()) / size;
+}
+
+// throughput is counted in decoded bytes
+void decode(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  std::vector<uint8_t> encoded;
+  huffman::encode(bytes(s), s.size(), encoded, corpus_options(state));
+  std::vector<uint8_t> dst(s.size());
+  for (auto _ : state) {
+    huffman::decode(encoded.data(), encoded.size(), dst.data(), dst.size());
+    benchmark::DoNotOptimize(dst.data());
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+}
+
+// 1 KiB messages of the corpus, each one a separate block mode stream
+void encode_messages(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  std::vector<uint8_t> dst(huffman::max_compressed_size(MESSAGE_SIZE));
+  size_t messages = 1024;
+  for (auto _ : state) {
+    for (size_t i = 0; i < messages; i++) {
+      benchmark::DoNotOptimize(
+          huffman::encode(bytes(s) + i * MESSAGE_SIZE, MESSAGE_SIZE, dst.data(), dst.size()));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * messages * MESSAGE_SIZE);
+}
+
+// same messages coded in a single call into one arena
+void encode_batch(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  size_t messages = 1024;
+  std::vector<huffman::buffer> inputs;
+  for (size_t i = 0; i < messages; i++) {
+    inputs.push_back({bytes(s) + i * MESSAGE_SIZE, MESSAGE_SIZE});
+  }
+  huffman::batch_output out;
+  for (auto _ : state) {
+    huffman::encode_batch(inputs.data(), inputs.size(), out);
+    benchmark::DoNotOptimize(out.data.data());
+  }
+  state.SetBytesProcessed(state.iterations() * messages * MESSAGE_SIZE);
+}
+
+void decode_messages(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  size_t messages = 1024;
+  std::vector<std::vector<uint8_t>> encoded(messages);
+  for (size_t i = 0; i < messages; i++) {
+    huffman::encode(bytes(s) + i * MESSAGE_SIZE, MESSAGE_SIZE, encoded[i]);
+  }
+  std::vector<uint8_t> dst(MESSAGE_SIZE);
+  for (auto _ : state) {
+    for (std::vector<uint8_t> const& e : encoded) {
+      benchmark::DoNotOptimize(huffman::decode(e.data(), e.size(), dst.data(), dst.size()));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * messages * MESSAGE_SIZE);
+}
+
+// same messages coded by a model trained on the corpus, without headers
+void model_messages(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  huffman::model model = huffman::model::train(bytes(s), s.size());
+  size_t messages = 1024;
+  std::vector<uint8_t> encoded, decoded;
+  for (auto _ : state) {
+    for (size_t i = 0; i < messages; i++) {
+      encoded.clear();
+      decoded.clear();
+      model.encode(bytes(s) + i * MESSAGE_SIZE, MESSAGE_SIZE, encoded);
+      model.decode(encoded.data(), encoded.size(), decoded);
+    }
+    benchmark::DoNotOptimize(decoded.data());
+  }
+  state.SetBytesProcessed(state.iterations() * messages * MESSAGE_SIZE);
+}
+
+// code and decoding table construction from counts, 256 samples make the
+// histogram negligible
+void build_code(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(huffman::model::train(bytes(s), 256));
+  }
+}
+
+// decoding table construction from code lengths
+void build_decoding_table(benchmark::State& state) {
+  std::string const& s = corpus_data(state.range(0));
+  std::vector<uint8_t> lengths;
+  huffman::model::train(bytes(s), s.size()).save(lengths);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(huffman::model::load(lengths.data(), lengths.size()));
+  }
+}
+
+// short inputs using all chars, where building the code dominates
+void encode_small(benchmark::State& state) {
+  std::string s = random_string(state.range(0), std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max());
+  for (auto _ : state) {
+    std::stringstream src(s), dst;
+    huffman::encode(src, dst);
+    benchmark::DoNotOptimize(dst);
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+}
+
+std::string histogram_input(benchmark::State& state) {
+  return state.range(0) == 0 ? random_string(CORPUS_SIZE, std::numeric_limits<char>::min(),
+                                             std::numeric_limits<char>::max())
+                             : std::string(CORPUS_SIZE, 'a');
+}
+
+// range(0) is 0 for uniform random bytes and 1 for a single repeated byte
+void histogram(benchmark::State& state) {
+  std::string s = histogram_input(state);
+  for (auto _ : state) {
+    std::array<uint64_t, 256> counts{};
+    huffman::histogram(reinterpret_cast<uint8_t const*>(s.data()), s.size(), counts);
+    benchmark::DoNotOptimize(counts);
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+}
+
+// single counters array, as a reference for histogram
+void histogram_naive(benchmark::State& state) {
+  std::string s = histogram_input(state);
+  for (auto _ : state) {
+    std::array<uint64_t, 256> counts{};
+    for (char c : s) {
+      counts[static_cast<unsigned char>(c)]++;
+    }
+    benchmark::DoNotOptimize(counts);
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+}
+
+// block checksums, to compare with decode throughput
+void checksum(benchmark::State& state) {
+  std::string s = random_string(CORPUS_SIZE, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        huffman::checksum(reinterpret_cast<uint8_t const*>(s.data()), s.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+}
+
+void corpora(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"corpus", "interleaved"});
+  for (int64_t c : {uniform, single_byte, text, zipf, executable}) {
+    b->Args({c, 0});
+    b->Args({c, 1});
+  }
+}
+} // namespace
+
+// corpus: 0 uniform random, 1 single byte, 2 english text, 3 zipf
+// distributed bytes, 4 executable
+BENCHMARK(encode)->Apply(corpora)->Unit(benchmark::kMillisecond);
+BENCHMARK(encode_sampled)
+    ->ArgsProduct({{uniform, single_byte, text, zipf, executable}, {1000, 100, 20}})
+    ->ArgNames({"corpus", "sample"})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(encode_drifting)->ArgName("blocks")->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+BENCHMARK(decode)->Apply(corpora)->Unit(benchmark::kMillisecond);
+BENCHMARK(encode_messages)->ArgName("corpus")->DenseRange(uniform, executable);
+BENCHMARK(encode_batch)->ArgName("corpus")->DenseRange(uniform, executable);
+BENCHMARK(decode_messages)->ArgName("corpus")->DenseRange(uniform, executable);
+BENCHMARK(model_messages)->ArgName("corpus")->DenseRange(uniform, executable);
+BENCHMARK(build_code)->ArgName("corpus")->DenseRange(uniform, executable);
+BENCHMARK(build_decoding_table)->ArgName("corpus")->DenseRange(uniform, executable);
+BENCHMARK(encode_small)->Arg(256)->Arg(1 << 10)->Arg(16 << 10);
+BENCHMARK(histogram)->ArgName("single_byte")->Arg(0)->Arg(1);
+BENCHMARK(histogram_naive)->ArgName("single_byte")->Arg(0)->Arg(1);
+BENCHMARK(checksum);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,110 @@
+#include "../huffman-lib/huffman.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+// output bound, so that headers claiming huge blocks throw instead of
+// allocating
+constexpr size_t MAX_OUTPUT = size_t{1} << 20;
+
+// every decoder of untrusted input either throws std::invalid_argument or
+// returns; none of them may read or write out of bounds
+void decode_all(uint8_t const* data, size_t size) {
+  std::vector<uint8_t> out(MAX_OUTPUT);
+  size_t decoded{0};
+  bool valid{true};
+  try {
+    decoded = huffman::decode(data, size, out.data(), out.size());
+  } catch (std::invalid_argument const&) {
+    valid = false;
+  }
+  for (size_t threads : {1, 3}) {
+    for (size_t table_bits : {huffman::MIN_TABLE_BITS, huffman::MAX_TABLE_BITS}) {
+      huffman::decode_options options;
+      options.threads = threads;
+      options.table_bits = table_bits;
+      std::vector<uint8_t> other(MAX_OUTPUT);
+      try {
+        size_t n = huffman::decode(data, size, other.data(), other.size(), options);
+        // the same input decodes the same whatever the options
+        if (!valid || n != decoded ||
+            !std::equal(out.begin(), out.begin() + n, other.begin())) {
+          std::abort();
+        }
+      } catch (std::invalid_argument const&) {
+        if (valid) {
+          std::abort();
+        }
+      }
+    }
+  }
+
+  try {
+    huffman::decoder decoder;
+    std::vector<uint8_t> dst;
+    for (size_t i = 0; i < size && dst.size() <= MAX_OUTPUT; i += 7) {
+      decoder.feed(data + i, std::min<size_t>(7, size - i), dst);
+    }
+    decoder.finish();
+  } catch (std::invalid_argument const&) {
+  }
+
+  try {
+    std::vector<uint8_t> range;
+    huffman::decode_range(data, size, size / 3, 100, range);
+  } catch (std::invalid_argument const&) {
+  }
+
+  // first 256 bytes as a model, the rest as its message
+  if (size >= 256) {
+    try {
+      huffman::model model = huffman::model::load(data, 256);
+      std::vector<uint8_t> dst;
+      model.decode(data + 256, std::min(size - 256, MAX_OUTPUT / 8), dst);
+    } catch (std::invalid_argument const&) {
+    }
+  }
+}
+
+// input as plain data to encode, with options picked by its first byte,
+// has to decode back
+void round_trip(uint8_t const* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  options.interleaved = data[0] & 1;
+  options.order1 = data[0] & 2;
+  options.checksums = data[0] & 4;
+  options.index = data[0] & 8;
+  options.adaptive = data[0] & 16;
+  options.code_length_limit = data[0] & 32 ? huffman::MIN_CODE_LENGTH_LIMIT
+                                           : huffman::MAX_CODE_LENGTH_LIMIT;
+  options.bwt = data[0] & 64;
+  if (data[0] & 128) {
+    // codes from a few pieces often miss chars, or don't fit and fall back
+    // to raw; the byte is full, so the size picks where pieces start
+    options.sample_fraction = 0.05;
+    options.random_sampling = size % 2;
+  }
+  std::vector<uint8_t> encoded, decoded;
+  huffman::encode(data + 1, size - 1, encoded, options);
+  huffman::decode(encoded.data(), encoded.size(), decoded);
+  if (decoded != std::vector<uint8_t>(data + 1, data + size)) {
+    std::abort();
+  }
+}
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size) {
+  decode_all(data, size);
+  round_trip(data, size);
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include "huffman.h"
+
+namespace {
+// xxHash32 by Yann Collet: 4 independent lanes consume 16 bytes per round,
+// so their multiplications overlap instead of forming one chain
+constexpr uint32_t PRIME1 = 0x9E3779B1u;
+constexpr uint32_t PRIME2 = 0x85EBCA77u;
+constexpr uint32_t PRIME3 = 0xC2B2AE3Du;
+constexpr uint32_t PRIME4 = 0x27D4EB2Fu;
+constexpr uint32_t PRIME5 = 0x165667B1u;
+
+uint32_t rotl(uint32_t val, unsigned bits) {
+  return (val << bits) | (val >> (32 - bits));
+}
+
+uint32_t load32(uint8_t const* p) {
+  return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+         static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+uint32_t round(uint32_t acc, uint32_t input) {
+  return rotl(acc + input * PRIME2, 13) * PRIME1;
+}
+} // namespace
+
+uint32_t huffman::checksum(uint8_t const* data, size_t size) {
+  uint8_t const* last = data + size;
+  uint32_t hash;
+  if (size >= 16) {
+    uint32_t lanes[4]{PRIME1 + PRIME2, PRIME2, 0, 0u - PRIME1};
+    uint8_t const* rounds_last = data + size / 16 * 16;
+    for (; data != rounds_last; data += 16) {
+      for (size_t i = 0; i < 4; i++) {
+        lanes[i] = round(lanes[i], load32(data + 4 * i));
+      }
+    }
+    hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) +
+           rotl(lanes[3], 18);
+  } else {
+    hash = PRIME5;
+  }
+  hash += static_cast<uint32_t>(size);
+  for (; last - data >= 4; data += 4) {
+    hash = rotl(hash + load32(data) * PRIME3, 17) * PRIME4;
+  }
+  for (; data != last; data++) {
+    hash = rotl(hash + *data * PRIME5, 11) * PRIME1;
+  }
+  hash ^= hash >> 15;
+  hash *= PRIME2;
+  hash ^= hash >> 13;
+  hash *= PRIME3;
+  hash ^= hash >> 16;
+  return hash;
+}
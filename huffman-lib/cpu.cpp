@@ -0,0 +1,27 @@
+#include "cpu.h"
+#include <atomic>
+
+namespace {
+huffman::detail::cpu_features detect() {
+  huffman::detail::cpu_features features;
+#ifdef HUFFMAN_X86_VARIANTS
+  __builtin_cpu_init();
+  features.bmi2 = __builtin_cpu_supports("bmi2");
+#endif
+  return features;
+}
+
+// loads are relaxed: features only pick among kernels of the same result
+std::atomic<huffman::detail::cpu_features>& features() {
+  static std::atomic<huffman::detail::cpu_features> f{detect()};
+  return f;
+}
+} // namespace
+
+huffman::detail::cpu_features huffman::detail::cpu() {
+  return features().load(std::memory_order_relaxed);
+}
+
+void huffman::detail::set_cpu(cpu_features const& f) {
+  features().store(f, std::memory_order_relaxed);
+}
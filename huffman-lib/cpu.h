@@ -0,0 +1,26 @@
+#pragma once
+
+// kernels get variants for x86 extensions where the compiler can build
+// single functions for them; other targets use the portable ones
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define HUFFMAN_X86_VARIANTS 1
+// compiles a function and everything inlined into it for the extension,
+// callers check cpu() first
+#define HUFFMAN_TARGET_BMI2 __attribute__((target("bmi2"), flatten))
+#endif
+
+namespace huffman::detail {
+// extensions there are kernel variants for, detected at the first call
+struct cpu_features {
+  // shifts by any register and bit field extraction, for the bit reader
+  bool bmi2{false};
+};
+
+cpu_features cpu();
+// replaces the detected features, for tests only, so that they can run
+// every variant the machine supports. Features are atomic, so coding
+// threads may read them meanwhile, but a call picks its kernels once and
+// keeps them.
+void set_cpu(cpu_features const& features);
+} // namespace huffman::detail
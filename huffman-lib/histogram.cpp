@@ -0,0 +1,51 @@
+#include "huffman.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// Increments of the same counter for repeated bytes form a store to load
+// dependency chain, so consecutive bytes go to different sub histograms.
+// 32-bit counters keep all of them in 8 KiB.
+constexpr size_t SUB_HISTOGRAMS = 8;
+// counters can't overflow within a chunk
+constexpr size_t CHUNK_SIZE = size_t{1} << 31;
+
+uint64_t load64(uint8_t const* p) {
+  uint64_t val;
+  std::memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+void histogram_chunk(uint8_t const* data, size_t size,
+                     std::array<uint64_t, 256>& counts) {
+  uint32_t sub[SUB_HISTOGRAMS][256]{};
+  uint8_t const* last = data + size;
+  uint8_t const* unrolled_last = data + size / 16 * 16;
+  for (; data != unrolled_last; data += 16) {
+    for (size_t i = 0; i < 16; i += 8) {
+      uint64_t word = load64(data + i);
+      for (size_t j = 0; j < SUB_HISTOGRAMS; j++) {
+        sub[j][(word >> (8 * j)) & 0xFF]++;
+      }
+    }
+  }
+  for (; data != last; data++) {
+    sub[0][*data]++;
+  }
+  for (size_t i = 0; i < 256; i++) {
+    for (size_t j = 0; j < SUB_HISTOGRAMS; j++) {
+      counts[i] += sub[j][i];
+    }
+  }
+}
+} // namespace
+
+void huffman::histogram(uint8_t const* data, size_t size,
+                        std::array<uint64_t, 256>& counts) {
+  while (size > 0) {
+    size_t chunk{std::min(size, CHUNK_SIZE)};
+    histogram_chunk(data, chunk, counts);
+    data += chunk;
+    size -= chunk;
+  }
+}
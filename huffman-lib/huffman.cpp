@@ -1,12 +1,23 @@
 #include "huffman.h"
+#include "cpu.h"
+#include "thread_pool.h"
+#include "transform.h"
 #include <algorithm>
 #include <array>
+#include <bitset>
+#include <chrono>
+#include <cmath>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <iterator>
 #include <limits>
-#include <memory>
 #include <numeric>
-#include <queue>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 using namespace huffman;
 
@@ -14,6 +25,70 @@ namespace {
 constexpr size_t CODE_WIDTH = 64;
 using code_val_t = uint64_t;
 
+// adds time of its scope to a phase of s, does nothing when s is null
+class phase_timer {
+public:
+  phase_timer(stats* s, std::chrono::nanoseconds stats::*phase)
+      : s(s), phase(phase) {
+    if (s) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+  phase_timer(phase_timer const&) = delete;
+  phase_timer& operator=(phase_timer const&) = delete;
+  ~phase_timer() {
+    if (s) {
+      s->*phase += std::chrono::steady_clock::now() - start;
+    }
+  }
+
+private:
+  stats* s;
+  std::chrono::nanoseconds stats::*phase;
+  std::chrono::steady_clock::time_point start;
+};
+
+// block mode stream starts with magic, format version and flags bytes.
+// Magic can't be a prefix of a single table stream, since its first code
+// length would be 255.
+constexpr std::array<unsigned char, 4> MAGIC{0xFF, 'H', 'U', 'F'};
+// version 1 stores 256 code lengths in every block, version 2 stores them
+// compactly and may have flags
+constexpr uint8_t FORMAT_VERSION = 2;
+
+// every block header ends with checksum of the block
+constexpr uint8_t FLAG_CHECKSUMS = 1;
+// end of stream is followed by the index of blocks
+constexpr uint8_t FLAG_INDEX = 2;
+constexpr uint8_t KNOWN_FLAGS = FLAG_CHECKSUMS | FLAG_INDEX;
+
+// every block starts with its type, all types but end are followed by
+// uncompressed and payload sizes, both 32-bit little endian
+enum class block_type : uint8_t {
+  end = 0,
+  huffman = 1,
+  // payload holds several streams that are decoded together
+  interleaved = 2,
+  // payload is the block itself, for input that Huffman coding can't shrink
+  raw = 3,
+  // payload is a single char, which fills the whole block
+  run = 4,
+  // every char is coded by the table of its context, the previous char
+  context = 5,
+  // chars are Burrows-Wheeler transformed, their move-to-front indices are
+  // coded by a single table
+  bwt = 6,
+};
+
+constexpr size_t INTERLEAVED_STREAMS = 4;
+
+// interleaved block is split into streams of equal number of chars, the last
+// one takes the rest; stream i starts at stream_start(size, i)
+size_t stream_start(size_t size, size_t i) {
+  size_t stream_size{(size + INTERLEAVED_STREAMS - 1) / INTERLEAVED_STREAMS};
+  return std::min(size, i * stream_size);
+}
+
 size_t char_to_ind(char ch) {
   return static_cast<size_t>(ch - std::numeric_limits<char>::min());
 }
@@ -28,52 +103,29 @@ struct code {
 };
 
 using code_map = std::array<code, 1 << (8 * sizeof(char))>;
+using count_map = std::array<size_t, 1 << (8 * sizeof(char))>;
 
-struct node {
-  node(size_t count) : count(count) {}
-  virtual void fill_code_lengths(code_map&, uint8_t depth) = 0;
-  virtual ~node() {}
-  size_t count;
-};
-
-struct inner_node : node {
-  inner_node(node* left, node* right)
-      : node(left->count + right->count), left(left), right(right) {}
-
-  void fill_code_lengths(code_map& codes, uint8_t depth) override {
-    left->fill_code_lengths(codes, depth + 1);
-    right->fill_code_lengths(codes, depth + 1);
-  }
-
-  std::unique_ptr<node> left;
-  std::unique_ptr<node> right;
-};
-
-struct leaf_node : node {
-  leaf_node(size_t count, char ch) : node(count), ch(ch) {}
-
-  void fill_code_lengths(code_map& codes, uint8_t depth) override {
-    codes[char_to_ind(ch)].length = std::max((uint8_t)1, depth);
+// throws if lengths don't form a prefix code, or are too long for
+// bit_reader to hold a code after a refill, so that the shifts below stay
+// within code_val_t
+std::array<size_t, 256> fill_canonical_code_values(code_map& codes) {
+  // chars ordered by length, then by value: counting sort by length keeps
+  // chars of the same length in order
+  std::array<size_t, 256> starts{};
+  for (code const& c : codes) {
+    if (c.length > CODE_WIDTH - 9) {
+      throw std::invalid_argument("code lengths corrupted");
+    }
+    starts[c.length]++;
   }
-
-  char ch;
-};
-
-struct nodes_greater {
-  bool operator()(node* a, node* b) {
-    return a->count > b->count;
+  size_t sum{0};
+  for (size_t& n : starts) {
+    sum += std::exchange(n, sum);
   }
-};
-
-std::array<size_t, 256> fill_canonical_code_values(code_map& codes) {
   std::array<size_t, 256> p;
-  std::iota(p.begin(), p.end(), 0);
-  std::sort(p.begin(), p.end(), [&codes](size_t i, size_t j) -> bool {
-    if (codes[i].length != codes[j].length) {
-      return codes[i].length < codes[j].length;
-    }
-    return i < j;
-  });
+  for (size_t i = 0; i < codes.size(); i++) {
+    p[starts[codes[i].length]++] = i;
+  }
 
   codes[p[0]].value = 0;
   for (size_t i = 1; i < codes.size(); i++) {
@@ -100,190 +152,3517 @@ std::array<size_t, 256> fill_canonical_code_values(code_map& codes) {
   return p;
 }
 
-template <typename T>
-std::enable_if_t<sizeof(T) == 1, std::ostream&> write_byte(std::ostream& os,
-                                                           T const& val) {
-  return os.put(reinterpret_cast<char const&>(val));
-}
-
-template <typename T>
-std::enable_if_t<sizeof(T) == 1, std::istream&> read_byte(std::istream& is,
-                                                          T& val) {
-  return is.get(reinterpret_cast<char&>(val));
+void count_occurrences(char const* first, char const* last, count_map& count) {
+  std::array<uint64_t, 256> byte_count{};
+  histogram(reinterpret_cast<uint8_t const*>(first), last - first, byte_count);
+  for (size_t i = 0; i < byte_count.size(); i++) {
+    count[char_to_ind(static_cast<char>(i))] += byte_count[i];
+  }
 }
-} // namespace
 
-void huffman::encode(std::istream& src, std::ostream& dst) {
-  src.exceptions(std::ios::badbit);
-  // count occurrences
-  std::array<size_t, 1u << (8 * sizeof(char))> count{};
-  char cur_ch;
-  while (src.get(cur_ch)) {
-    size_t ind{char_to_ind(cur_ch)};
-    count[ind]++;
+// optimal code lengths limited by the given length for n leaves sorted by
+// count, done with package-merge: every leaf among the items picked from the
+// list of a level adds one to its code length
+void limit_code_lengths(count_map const& count,
+                        std::array<size_t, 256> const& leaves, size_t n,
+                        code_map& codes, size_t limit) {
+  // level 0 list has only leaves, every next one merges leaves with pairs of
+  // the previous level items
+  std::array<std::bitset<2 * 256>, MAX_CODE_LENGTH_LIMIT> is_package{};
+  std::array<size_t, 2 * 256> weights;
+  std::array<size_t, 2 * 256> next_weights;
+  for (size_t i = 0; i < n; i++) {
+    weights[i] = count[leaves[i]];
   }
-  code_map codes;
-  // huffman coding
-  {
-    std::priority_queue<node*, std::vector<node*>, nodes_greater> pq;
-    for (size_t i = 0; i < count.size(); i++) {
-      if (count[i] > 0) {
-        pq.emplace(new leaf_node{count[i], ind_to_char(i)});
+  size_t size{n};
+  for (size_t level = 1; level < limit; level++) {
+    size_t packages{size / 2};
+    size_t i{0}, j{0}, k{0};
+    while (i < n || j < packages) {
+      size_t package = j < packages ? weights[2 * j] + weights[2 * j + 1] : 0;
+      if (j == packages || (i < n && count[leaves[i]] <= package)) {
+        next_weights[k] = count[leaves[i++]];
       } else {
-        // unused characters have zero length code
-        codes[i].length = 0;
+        next_weights[k] = package;
+        is_package[level][k] = true;
+        j++;
       }
+      k++;
     }
-    while (pq.size() > 1) {
-      node* left = pq.top();
-      pq.pop();
-      node* right = pq.top();
-      pq.pop();
-      pq.push(new inner_node(left, right));
+    size = k;
+    std::swap(weights, next_weights);
+  }
+
+  size_t take{2 * n - 2};
+  for (size_t level = limit; level-- > 0 && take > 0;) {
+    size_t packages{0};
+    for (size_t k = 0; k < take; k++) {
+      packages += is_package[level][k];
     }
-    if (!pq.empty()) {
-      // fill code_map
-      node* root = pq.top();
-      root->fill_code_lengths(codes, 0);
-      delete root;
+    for (size_t i = 0; i < take - packages; i++) {
+      codes[leaves[i]].length++;
     }
-    fill_canonical_code_values(codes);
+    take = 2 * packages;
   }
+}
 
-  for (code& c : codes) {
-    write_byte(dst, c.length);
+// chars with non zero count, sorted by count
+size_t sort_by_count(count_map const& count, std::array<size_t, 256>& order) {
+  size_t n{0};
+  for (size_t i = 0; i < count.size(); i++) {
+    if (count[i] > 0) {
+      order[n++] = i;
+    }
   }
+  std::sort(order.begin(), order.begin() + n, [&count](size_t i, size_t j) {
+    return count[i] != count[j] ? count[i] < count[j] : i < j;
+  });
+  return n;
+}
 
-  size_t msg_length{0};
-  for (size_t i = 0; i < 256; i++) {
-    msg_length += count[i] * codes[i].length;
+// Huffman code lengths computed in place over sorted weights, as described by
+// Moffat and Katajainen in "In-Place Calculation of Minimum-Redundancy Codes".
+// First pass combines weights and leaves parent pointers, second one turns
+// them into internal node depths and third one gives leaf depths.
+void fill_code_lengths(std::array<size_t, 256>& a, size_t n) {
+  if (n == 1) {
+    a[0] = 1;
+    return;
   }
-  uint8_t ignore_bits{static_cast<uint8_t>((8 - (msg_length % 8)) % 8)};
-  write_byte(dst, ignore_bits);
-  // encode message
-  src.clear();
-  src.seekg(0, std::ios::beg);
-  code_val_t buff{0};
-  unsigned buff_len{0};
-  auto flush_buffer = [&dst, &buff, &buff_len]() -> void {
-    while (buff_len > 0) {
-      write_byte(dst, static_cast<uint8_t>(buff >> (CODE_WIDTH - 8)));
-      buff <<= 8;
-      buff_len = buff_len >= 8 ? buff_len - 8 : 0;
+  a[0] += a[1];
+  size_t root{0}, leaf{2};
+  for (size_t next = 1; next < n - 1; next++) {
+    if (leaf >= n || a[root] < a[leaf]) {
+      a[next] = a[root];
+      a[root++] = next;
+    } else {
+      a[next] = a[leaf++];
     }
-  };
-  while (src.get(cur_ch)) {
-    code& cur_code = codes[char_to_ind(cur_ch)];
-    if (buff_len + cur_code.length > CODE_WIDTH) {
-      uint8_t can_write = CODE_WIDTH - buff_len;
-      buff |= cur_code.value >> (cur_code.length - can_write);
-      buff_len = CODE_WIDTH;
-      flush_buffer();
-      buff |= cur_code.value
-           << (CODE_WIDTH - buff_len - cur_code.length + can_write);
-      buff_len += cur_code.length - can_write;
+    if (leaf >= n || (root < next && a[root] < a[leaf])) {
+      a[next] += a[root];
+      a[root++] = next;
     } else {
-      buff |= cur_code.value << (CODE_WIDTH - buff_len - cur_code.length);
-      buff_len += cur_code.length;
+      a[next] += a[leaf++];
     }
   }
-  if (buff_len > 0) {
-    flush_buffer();
+  a[n - 2] = 0;
+  for (size_t next = n - 2; next-- > 0;) {
+    a[next] = a[a[next]] + 1;
+  }
+  size_t avbl{1}, used{0}, depth{0};
+  size_t root_pos{n - 1}, next{n};
+  while (avbl > 0) {
+    while (root_pos > 0 && a[root_pos - 1] == depth) {
+      used++;
+      root_pos--;
+    }
+    while (avbl > used) {
+      a[--next] = depth;
+      avbl--;
+    }
+    avbl = 2 * used;
+    depth++;
+    used = 0;
   }
 }
 
-void huffman::decode(std::istream& src, std::ostream& dst) {
-  src.exceptions(std::ios::badbit);
-  uint8_t max_length{0};
+// code lengths, values are left to fill_canonical_code_values
+code_map build_code_lengths(count_map const& count, size_t length_limit) {
   code_map codes{};
-  // read header
-  for (code& c : codes) {
-    read_byte(src, c.length);
+  std::array<size_t, 256> order;
+  size_t n{sort_by_count(count, order)};
+  if (n > 0) {
+    std::array<size_t, 256> lengths;
+    for (size_t i = 0; i < n; i++) {
+      lengths[i] = count[order[i]];
+    }
+    fill_code_lengths(lengths, n);
+    if (lengths[0] > length_limit) {
+      limit_code_lengths(count, order, n, codes, length_limit);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        codes[order[i]].length = static_cast<uint8_t>(lengths[i]);
+      }
+    }
+  }
+  return codes;
+}
+
+code_map build_codes(count_map const& count, size_t length_limit) {
+  code_map codes{build_code_lengths(count, length_limit)};
+  fill_canonical_code_values(codes);
+  return codes;
+}
+
+uint8_t max_code_length(code_map const& codes) {
+  uint8_t max_length{0};
+  for (code const& c : codes) {
     max_length = std::max(max_length, c.length);
   }
-  uint8_t ignore_bits;
-  read_byte(src, ignore_bits);
+  return max_length;
+}
 
-  if (src.eof()) {
-    throw std::invalid_argument("corrupted input header");
+size_t message_length(count_map const& count, code_map const& codes) {
+  size_t msg_length{0};
+  for (size_t i = 0; i < count.size(); i++) {
+    msg_length += count[i] * codes[i].length;
+  }
+  return msg_length;
+}
+
+// compilers turn it into a single byte swapped store
+void store_be64(char* p, uint64_t val) {
+  p[0] = static_cast<char>(val >> 56);
+  p[1] = static_cast<char>(val >> 48);
+  p[2] = static_cast<char>(val >> 40);
+  p[3] = static_cast<char>(val >> 32);
+  p[4] = static_cast<char>(val >> 24);
+  p[5] = static_cast<char>(val >> 16);
+  p[6] = static_cast<char>(val >> 8);
+  p[7] = static_cast<char>(val);
+}
+
+uint64_t load_be64(char const* p) {
+  uint64_t val{0};
+  for (size_t i = 0; i < 8; i++) {
+    val = val << 8 | static_cast<unsigned char>(p[i]);
   }
+  return val;
+}
 
-  if (ignore_bits > 8) {
-    throw std::invalid_argument("bad ignore_bits value");
+// accumulates codes at the top of a 64-bit register, which is stored as
+// a whole big endian word, the partial byte stays in the register
+class bit_writer {
+public:
+  explicit bit_writer(char* out) : out(out) {}
+
+  // fits while at most 64 bits are buffered
+  void put(code const& c) {
+    buff |= c.value << (CODE_WIDTH - buff_len - c.length);
+    buff_len += c.length;
   }
 
-  // fill codes
-  std::array<size_t, 256> p = fill_canonical_code_values(codes);
-  std::array<size_t, 256> inv_p;
-  for (size_t i = 0; i < p.size(); i++) {
-    inv_p[p[i]] = i;
+  // needs 8 bytes of space and at most 63 bits buffered
+  void flush() {
+    store_be64(out, buff);
+    out += buff_len / 8;
+    buff <<= buff_len & ~7u;
+    buff_len &= 7;
   }
-  std::array<size_t, 256> smallest_char;
-  std::array<code_val_t const*, 256> smallest_code;
-  std::array<code_val_t, 256> next_smallest_code;
-  smallest_char[codes[p[0]].length] = p[0];
-  smallest_code[codes[p[0]].length] = &codes[p[0]].value;
-  for (size_t i = 1; i < codes.size(); i++) {
-    uint8_t cur_length{codes[p[i]].length};
-    uint8_t prev_length{codes[p[i - 1]].length};
-    if (cur_length != prev_length) {
-      smallest_char[cur_length] = p[i];
-      smallest_code[cur_length] = &codes[p[i]].value;
-      next_smallest_code[prev_length] = codes[p[i]].value
-                                     << (CODE_WIDTH - 1 - cur_length);
+
+  // stores whole bytes one by one
+  void flush_tail() {
+    while (buff_len >= 8) {
+      *out++ = static_cast<char>(buff >> (CODE_WIDTH - 8));
+      buff <<= 8;
+      buff_len -= 8;
     }
   }
 
-  std::array<size_t, 256> start;
-  std::fill(start.begin(), start.end(), 256);
-  for (size_t i = 0; i < 256; i++) {
-    auto& c = codes[i];
-    if (codes[i].length == 0) {
-      continue;
+  // writes the last byte padded with zeros, returns the end of output
+  char* finish() {
+    flush_tail();
+    if (buff_len > 0) {
+      *out++ = static_cast<char>(buff >> (CODE_WIDTH - 8));
+      buff = 0;
+      buff_len = 0;
     }
-    if (c.length >= 8) {
-      uint8_t first_byte = c.value >> (c.length - 8);
-      start[first_byte] =
-          std::min(start[first_byte], static_cast<size_t>(c.length));
-    } else {
-      uint8_t first_byte = c.value << (8 - c.length);
-      for (size_t i = 0; i < (1 << (8 - c.length)); i++) {
-        start[first_byte | i] =
-            std::min(start[first_byte | i], static_cast<size_t>(c.length));
+    return out;
+  }
+
+  char* position() const {
+    return out;
+  }
+
+  // continues at new output position, keeping the partial byte
+  void rewind(char* new_out) {
+    out = new_out;
+  }
+
+private:
+  char* out;
+  code_val_t buff{0};
+  unsigned buff_len{0};
+};
+
+// K codes at most max_length long are put between flushes, that fits since
+// at most 7 bits are left after a flush; code_of(ch) is called for every
+// char in order. Bounded stops when the rest may not fit before out_end,
+// fewer than K codes and the partial byte always fit in 8 bytes.
+template <size_t K, bool Bounded, typename CodeOf>
+bool put_codes(bit_writer& writer, char const* first, char const* last,
+               CodeOf& code_of, char const* out_end) {
+  while (static_cast<size_t>(last - first) >= K &&
+         out_end - writer.position() >= 8) {
+    for (size_t i = 0; i < K; i++) {
+      writer.put(code_of(first[i]));
+    }
+    first += K;
+    writer.flush();
+  }
+  if (Bounded && first != last &&
+      (static_cast<size_t>(last - first) >= K ||
+       out_end - writer.position() < 8)) {
+    return false;
+  }
+  for (; first != last; ++first) {
+    writer.put(code_of(*first));
+    writer.flush_tail();
+  }
+  return true;
+}
+
+// writes codes of [first, last) chars, none of them longer than max_length;
+// output up to out_end must have space for all of them, 8 byte stores stop
+// 8 bytes before it. Bounded output may be too short, then returns false
+// with some of the codes written.
+template <bool Bounded = false, typename CodeOf>
+bool put_codes(bit_writer& writer, char const* first, char const* last,
+               CodeOf code_of, uint8_t max_length, char const* out_end) {
+  if (max_length <= 14) {
+    return put_codes<4, Bounded>(writer, first, last, code_of, out_end);
+  } else if (max_length <= 28) {
+    return put_codes<2, Bounded>(writer, first, last, code_of, out_end);
+  } else {
+    return put_codes<1, Bounded>(writer, first, last, code_of, out_end);
+  }
+}
+
+template <bool Bounded = false>
+bool put_chars(bit_writer& writer, char const* first, char const* last,
+               code_map const& codes, uint8_t max_length, char const* out_end) {
+  return put_codes<Bounded>(
+      writer, first, last,
+      [&codes](char ch) -> code const& { return codes[char_to_ind(ch)]; },
+      max_length, out_end);
+}
+
+// keeps up to CODE_WIDTH - 1 next message bits aligned to the top of buff
+template <typename InputIt>
+struct bit_reader {
+  // buff holds message bits left from the previous part of input
+  bit_reader(InputIt first, InputIt last, code buff = {0, 0})
+      : first(first), last(last), buff(buff) {
+    refill();
+  }
+
+  void refill() {
+    // memory input takes all the whole bytes that fit with a single load,
+    // bits loaded past them are the same that next refill brings; shifts
+    // are split, since a carried buff may be full
+    if constexpr (std::is_pointer_v<InputIt>) {
+      if (last - first >= 8) {
+        buff.value |= (load_be64(first) >> 1) >> buff.length;
+        size_t bytes{(CODE_WIDTH - 1 - buff.length) / 8};
+        first += bytes;
+        buff.length += static_cast<uint8_t>(8 * bytes);
+        return;
       }
     }
+    refill_bytes();
+  }
+
+  // byte by byte, for the end of memory input and other iterators, kept
+  // apart so that the load above stays small enough to inline
+  void refill_bytes() {
+    while (buff.length + 8 <= CODE_WIDTH - 1 && first != last) {
+      buff.value |= static_cast<code_val_t>(static_cast<unsigned char>(*first))
+                 << (CODE_WIDTH - 9 - buff.length);
+      ++first;
+      buff.length += 8;
+    }
+  }
+
+  void consume(uint8_t length) {
+    drop(length);
+    refill();
+  }
+
+  // consume without the refill, which the caller does after a few of them
+  void drop(uint8_t length) {
+    buff.length -= length;
+    buff.value <<= length;
+    buff.value &= (static_cast<code_val_t>(1) << (CODE_WIDTH - 1)) - 1;
+  }
+
+  bool exhausted() const {
+    return first == last;
   }
 
-  next_smallest_code[max_length] = 1;
-  next_smallest_code[max_length] <<= CODE_WIDTH - 1;
-  // read message
-  code cur_code{0, 0};
-  auto read_buff = [&]() -> void {
-    unsigned char cur_ch;
-    while (cur_code.length + 8 <= CODE_WIDTH - 1 && read_byte(src, cur_ch)) {
-      cur_code.value |= static_cast<code_val_t>(cur_ch)
-                     << (CODE_WIDTH - 9 - cur_code.length);
-      cur_code.length += 8;
+  InputIt first;
+  InputIt last;
+  code buff{0, 0};
+  // chars decoded by canonical code bounds
+  uint64_t long_codes{0};
+};
+
+// decodes multiple short codes with a single lookup of the next table_bits
+// message bits, longer codes are found by the canonical code bounds
+class decoding_table {
+public:
+  // fills canonical code values, throws if lengths don't form a prefix code
+  decoding_table(code_map& codes, size_t table_bits) {
+    build(codes, table_bits);
+  }
+
+  // same as constructing the table anew, but keeps its memory
+  void build(code_map& codes, size_t table_bits) {
+    this->table_bits = table_bits;
+    table.assign(size_t{1} << table_bits, {});
+    first_ind.fill(0);
+    smallest_code.fill(0);
+    max_length = max_code_length(codes);
+    std::array<size_t, 256> order{fill_canonical_code_values(codes)};
+    // the prefix code is found complete by the Kraft sum once here, so that
+    // kernels of tables holding all the codes have no lookup to miss
+    code_val_t kraft{0};
+    for (code const& c : codes) {
+      if (c.length != 0) {
+        kraft += static_cast<code_val_t>(1) << (max_length - c.length);
+      }
+    }
+    complete = max_length != 0 && kraft == static_cast<code_val_t>(1)
+                                               << max_length;
+    std::copy(order.begin(), order.end(), p.begin());
+
+    std::fill(next_smallest_code.begin(), next_smallest_code.end(),
+              static_cast<code_val_t>(1) << (CODE_WIDTH - 1));
+    first_ind[codes[p[0]].length] = 0;
+    smallest_code[codes[p[0]].length] = codes[p[0]].value;
+    for (size_t i = 1; i < codes.size(); i++) {
+      uint8_t cur_length{codes[p[i]].length};
+      uint8_t prev_length{codes[p[i - 1]].length};
+      if (cur_length != prev_length) {
+        first_ind[cur_length] = static_cast<uint16_t>(i);
+        smallest_code[cur_length] = codes[p[i]].value;
+        // lengths without codes share the bound of the next used length
+        for (size_t len = prev_length; len < cur_length; len++) {
+          next_smallest_code[len] = codes[p[i]].value
+                                 << (CODE_WIDTH - 1 - cur_length);
+        }
+      }
     }
-    cur_code.value &= (static_cast<code_val_t>(1) << (CODE_WIDTH - 1)) - 1;
+
+    for (size_t i = 0; i < codes.size(); i++) {
+      code const& c = codes[i];
+      if (c.length == 0 || c.length > table_bits) {
+        continue;
+      }
+      size_t first = c.value << (table_bits - c.length);
+      size_t last = (c.value + 1) << (table_bits - c.length);
+      for (size_t j = first; j < last; j++) {
+        table[j] = {{static_cast<uint8_t>(i), 0}, c.length, c.length};
+      }
+    }
+    // append the second code when it fits in the rest of the lookup bits
+    size_t mask = table.size() - 1;
+    for (size_t i = 0; i < table.size(); i++) {
+      table_entry& e = table[i];
+      if (e.first_length == 0) {
+        continue;
+      }
+      table_entry const& next = table[(i << e.first_length) & mask];
+      if (next.first_length != 0 &&
+          e.first_length + next.first_length <= table_bits) {
+        e.symbols[1] = next.symbols[0];
+        e.length = e.first_length + next.first_length;
+      }
+    }
+  }
+
+  // decodes chars into [out, out_end) while there are message bits left,
+  // last ignore_bits of the input are padding; returns the end of output
+  template <typename InputIt>
+  char* decode(bit_reader<InputIt>& reader, char* out, char* out_end,
+               uint8_t ignore_bits) const {
+    auto kernel = with_kernel([](auto bits, auto long_codes) {
+      constexpr size_t BITS{decltype(bits)::value};
+      constexpr bool LONG_CODES{decltype(long_codes)::value};
+#ifdef HUFFMAN_X86_VARIANTS
+      if (detail::cpu().bmi2) {
+        return &decoding_table::decode_kernel_bmi2<BITS, LONG_CODES, InputIt>;
+      }
+#endif
+      return &decoding_table::decode_kernel<BITS, LONG_CODES, InputIt>;
+    });
+    return (this->*kernel)(reader, out, out_end, ignore_bits);
+  }
+
+  // decodes every stream into [outs[i], out_ends[i]) in the same loop, so
+  // that their lookups don't wait for each other; stops when one of them
+  // gets close to the end of input or output, the rest is left to decode
+  template <typename InputIt, size_t N>
+  void decode_interleaved(std::array<bit_reader<InputIt>, N>& readers,
+                          std::array<char*, N>& outs,
+                          std::array<char*, N> const& out_ends) const {
+    auto kernel = with_kernel([](auto bits, auto long_codes) {
+      constexpr size_t BITS{decltype(bits)::value};
+      constexpr bool LONG_CODES{decltype(long_codes)::value};
+#ifdef HUFFMAN_X86_VARIANTS
+      if (detail::cpu().bmi2) {
+        return &decoding_table::decode_interleaved_kernel_bmi2<BITS, LONG_CODES,
+                                                               InputIt, N>;
+      }
+#endif
+      return &decoding_table::decode_interleaved_kernel<BITS, LONG_CODES,
+                                                        InputIt, N>;
+    });
+    (this->*kernel)(readers, outs, out_ends);
+  }
+
+  // decodes a single char from at most avail message bits, for codes that
+  // change after every char, so that it can't be paired with the next one
+  template <typename InputIt>
+  size_t decode_char(bit_reader<InputIt>& reader, size_t avail) const {
+    return with_kernel([&](auto bits, auto long_codes) {
+      constexpr size_t BITS{decltype(bits)::value};
+      table_entry const& e =
+          table[reader.buff.value >> (CODE_WIDTH - 1 - BITS)];
+      if (decltype(long_codes)::value && e.first_length == 0) {
+        return decode_long<BITS, decltype(long_codes)::value>(reader, avail);
+      }
+      if (e.first_length > avail) {
+        throw std::invalid_argument("corrupted input message");
+      }
+      reader.consume(e.first_length);
+      return size_t{e.symbols[0]};
+    });
+  }
+
+private:
+  struct table_entry {
+    uint8_t symbols[2];
+    // bits taken by all the decoded chars
+    uint8_t length;
+    // bits taken by the first char, 0 if its code is longer than the table
+    uint8_t first_length;
   };
-  read_buff();
-  while (!src.eof() || cur_code.length > ignore_bits) {
-    size_t cur_length = start[cur_code.value >> (CODE_WIDTH - 9)];
-    assert(cur_length < 256);
-    if (cur_length > 8) {
+
+  // calls f(bits, long_codes) with table_bits and whether a lookup can miss
+  // the table, since a code is longer or the code isn't complete, as
+  // std::integral_constant, so that every kernel has constant shifts and the
+  // search of long codes only when it needs one. Loops call kernels by
+  // pointer, so that each one is compiled apart and inlines its refills.
+  template <typename F>
+  decltype(auto) with_kernel(F const& f) const {
+    static_assert(MIN_TABLE_BITS == 8 && MAX_TABLE_BITS == 12);
+    switch (table_bits) {
+    case 8:
+      return with_long_codes<8>(f);
+    case 9:
+      return with_long_codes<9>(f);
+    case 10:
+      return with_long_codes<10>(f);
+    case 11:
+      return with_long_codes<11>(f);
+    default:
+      return with_long_codes<12>(f);
+    }
+  }
+
+  template <size_t Bits, typename F>
+  decltype(auto) with_long_codes(F const& f) const {
+    if (max_length > Bits || !complete) {
+      return f(std::integral_constant<size_t, Bits>{}, std::true_type{});
+    }
+    return f(std::integral_constant<size_t, Bits>{}, std::false_type{});
+  }
+
+  template <size_t Bits, bool LongCodes, typename InputIt>
+  char* decode_kernel(bit_reader<InputIt>& reader, char* out, char* out_end,
+                      uint8_t ignore_bits) const {
+    code const& cur_code = reader.buff;
+    if constexpr (!LongCodes && std::is_pointer_v<InputIt>) {
+      constexpr size_t STEPS{short_steps(Bits)};
+      while (reader.last - reader.first >= 8 &&
+             static_cast<size_t>(out_end - out) >= 2 * STEPS) {
+        for (size_t i = 0; i < STEPS; i++) {
+          decode_short_step<Bits>(reader, out);
+        }
+        reader.refill();
+      }
+    }
+    while (out != out_end) {
+      size_t padding{reader.exhausted() ? ignore_bits : uint8_t{0}};
+      if (cur_code.length <= padding) {
+        break;
+      }
+      size_t avail{cur_code.length - padding};
+      table_entry const& e = table[cur_code.value >> (CODE_WIDTH - 1 - Bits)];
+      if (LongCodes && e.first_length == 0) {
+        *out++ = ind_to_char(decode_long<Bits, LongCodes>(reader, avail));
+      } else if (e.length <= avail && out_end - out >= 2) {
+        // the second char is overwritten later if there is just one
+        out[0] = ind_to_char(e.symbols[0]);
+        out[1] = ind_to_char(e.symbols[1]);
+        out += 1 + (e.length > e.first_length);
+        reader.consume(e.length);
+      } else if (e.first_length <= avail) {
+        *out++ = ind_to_char(e.symbols[0]);
+        reader.consume(e.first_length);
+      } else {
+        throw std::invalid_argument("corrupted input message");
+      }
+    }
+    return out;
+  }
+
+  template <size_t Bits, bool LongCodes, typename InputIt, size_t N>
+  void decode_interleaved_kernel(std::array<bit_reader<InputIt>, N>& readers,
+                                 std::array<char*, N>& outs,
+                                 std::array<char*, N> const& out_ends) const {
+    if constexpr (!LongCodes && std::is_pointer_v<InputIt>) {
+      constexpr size_t STEPS{short_steps(Bits)};
+      auto has_room = [&] {
+        for (size_t i = 0; i < N; i++) {
+          if (readers[i].last - readers[i].first < 8 ||
+              static_cast<size_t>(out_ends[i] - outs[i]) < 2 * STEPS) {
+            return false;
+          }
+        }
+        return true;
+      };
+      while (has_room()) {
+        for (size_t step = 0; step < STEPS; step++) {
+          for (size_t i = 0; i < N; i++) {
+            decode_short_step<Bits>(readers[i], outs[i]);
+          }
+        }
+        for (bit_reader<InputIt>& reader : readers) {
+          reader.refill();
+        }
+      }
+    }
+    // every step takes at most 2 chars of space and step_bits bits, since
+    // chars decoded together fit in the lookup bits and a long code in
+    // max_length; codes that miss the table may also be shorter than it
+    size_t step_bits{LongCodes ? std::max<size_t>(max_length, Bits) : Bits};
+    for (;;) {
+      size_t rounds{std::numeric_limits<size_t>::max()};
+      for (size_t i = 0; i < N; i++) {
+        size_t bits{readers[i].buff.length +
+                    8 * static_cast<size_t>(readers[i].last - readers[i].first)};
+        if (bits < CODE_WIDTH - 8 || out_ends[i] - outs[i] < 2) {
+          return;
+        }
+        rounds = std::min({rounds, (bits - (CODE_WIDTH - 8)) / step_bits + 1,
+                           static_cast<size_t>(out_ends[i] - outs[i]) / 2});
+      }
+      for (; rounds > 0; rounds--) {
+        for (size_t i = 0; i < N; i++) {
+          decode_step<Bits, LongCodes>(readers[i], outs[i]);
+        }
+      }
+    }
+  }
+
+#ifdef HUFFMAN_X86_VARIANTS
+  // the same kernels with BMI2 shifts, which take the shift count in any
+  // register and leave flags alone
+  template <size_t Bits, bool LongCodes, typename InputIt>
+  HUFFMAN_TARGET_BMI2 char* decode_kernel_bmi2(bit_reader<InputIt>& reader,
+                                               char* out, char* out_end,
+                                               uint8_t ignore_bits) const {
+    return decode_kernel<Bits, LongCodes>(reader, out, out_end, ignore_bits);
+  }
+
+  template <size_t Bits, bool LongCodes, typename InputIt, size_t N>
+  HUFFMAN_TARGET_BMI2 void
+  decode_interleaved_kernel_bmi2(std::array<bit_reader<InputIt>, N>& readers,
+                                 std::array<char*, N>& outs,
+                                 std::array<char*, N> const& out_ends) const {
+    decode_interleaved_kernel<Bits, LongCodes>(readers, outs, out_ends);
+  }
+#endif
+
+  // code of more than Bits bits, found by the bounds of canonical codes of
+  // every length, or bits without a code; without LongCodes the table holds
+  // a complete code, so there is no miss
+  template <size_t Bits, bool LongCodes, typename InputIt>
+  size_t decode_long(bit_reader<InputIt>& reader, size_t avail) const {
+    if constexpr (!LongCodes) {
+      throw std::invalid_argument("corrupted input message");
+    } else {
+      code const& cur_code = reader.buff;
+      size_t cur_length{Bits + 1};
       while (cur_code.value >= next_smallest_code[cur_length]) {
         cur_length++;
       }
+      if (cur_length > max_length || cur_length > avail) {
+        throw std::invalid_argument("corrupted input message");
+      }
+      size_t d = (cur_code.value >> (CODE_WIDTH - 1 - cur_length)) -
+                 smallest_code[cur_length];
+      if (size_t{first_ind[cur_length]} + d >= 256) {
+        throw std::invalid_argument("corrupted input message");
+      }
+      reader.consume(cur_length);
+      reader.long_codes++;
+      return p[first_ind[cur_length] + d];
     }
-    size_t d = (cur_code.value >> (CODE_WIDTH - 1 - cur_length)) -
-             *smallest_code[cur_length];
-    if (smallest_char[cur_length] + d >= 256) {
-      throw std::invalid_argument("corrupted input message");
+  }
+
+  // a refill with 8 bytes of input left gives at least CODE_WIDTH - 8 bits,
+  // enough for that many lookups when all codes are in the table
+  static constexpr size_t short_steps(size_t bits) {
+    return (CODE_WIDTH - 8) / bits;
+  }
+
+  // decode_step without the refill, for tables holding a complete code, so
+  // every entry has a char and there is nothing to check: the index has Bits
+  // bits and the entry takes at most Bits of them; out must have space for
+  // 2 chars
+  template <size_t Bits, typename InputIt>
+  void decode_short_step(bit_reader<InputIt>& reader, char*& out) const {
+    table_entry const& e = table[reader.buff.value >> (CODE_WIDTH - 1 - Bits)];
+    out[0] = ind_to_char(e.symbols[0]);
+    out[1] = ind_to_char(e.symbols[1]);
+    out += 1 + (e.length > e.first_length);
+    reader.drop(e.length);
+  }
+
+  // reader must hold at least max(max_length, table_bits) message bits and
+  // out must have space for 2 chars
+  template <size_t Bits, bool LongCodes, typename InputIt>
+  void decode_step(bit_reader<InputIt>& reader, char*& out) const {
+    table_entry const& e = table[reader.buff.value >> (CODE_WIDTH - 1 - Bits)];
+    if (LongCodes && e.first_length == 0) {
+      *out++ = ind_to_char(decode_long<Bits, LongCodes>(reader,
+                                                         reader.buff.length));
+    } else {
+      out[0] = ind_to_char(e.symbols[0]);
+      out[1] = ind_to_char(e.symbols[1]);
+      out += 1 + (e.length > e.first_length);
+      reader.consume(e.length);
+    }
+  }
+
+  size_t table_bits;
+  uint8_t max_length{0};
+  // Kraft sum of the code is 1, so with max_length up to table_bits every
+  // entry has a char
+  bool complete{false};
+  std::vector<table_entry> table;
+  // chars sorted by code, first_ind is position in p of the first code
+  // of every length; small types keep many tables in cache
+  std::array<uint8_t, 256> p;
+  std::array<uint16_t, CODE_WIDTH> first_ind;
+  std::array<code_val_t, CODE_WIDTH> smallest_code;
+  std::array<code_val_t, CODE_WIDTH> next_smallest_code;
+};
+
+template <typename T>
+std::enable_if_t<sizeof(T) == 1, std::ostream&> write_byte(std::ostream& os,
+                                                           T const& val) {
+  return os.put(reinterpret_cast<char const&>(val));
+}
+
+template <typename T>
+std::enable_if_t<sizeof(T) == 1, std::istream&> read_byte(std::istream& is,
+                                                          T& val) {
+  return is.get(reinterpret_cast<char&>(val));
+}
+
+constexpr size_t STREAM_HEADER_SIZE = MAGIC.size() + 2;
+constexpr size_t BLOCK_HEADER_SIZE = 9;
+constexpr size_t CHECKSUM_SIZE = 4;
+
+size_t block_header_size(uint8_t flags) {
+  return BLOCK_HEADER_SIZE + (flags & FLAG_CHECKSUMS ? CHECKSUM_SIZE : 0);
+}
+
+char* write_le32(char* out, uint32_t val) {
+  for (size_t i = 0; i < 4; i++) {
+    *out++ = static_cast<char>(val >> (8 * i));
+  }
+  return out;
+}
+
+uint32_t read_le32(char const* in) {
+  uint32_t val{0};
+  for (size_t i = 0; i < 4; i++) {
+    val |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+  }
+  return val;
+}
+
+constexpr size_t MAX_VARINT_SIZE = 10;
+
+// 7 bits per byte starting from the lowest ones, high bit is set in all the
+// bytes but the last
+char* write_varint(char* out, uint64_t val) {
+  while (val >= 0x80) {
+    *out++ = static_cast<char>(val | 0x80);
+    val >>= 7;
+  }
+  *out++ = static_cast<char>(val);
+  return out;
+}
+
+// returns position after the value
+char const* read_varint(char const* first, char const* last, uint64_t& val) {
+  val = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    if (first == last) {
+      throw std::invalid_argument("unexpected end of input");
     }
-    dst.put(ind_to_char(p[inv_p[smallest_char[cur_length]] + d]));
-    cur_code.length -= cur_length;
-    cur_code.value <<= cur_length;
-    read_buff();
+    unsigned char byte{static_cast<unsigned char>(*first++)};
+    val |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return first;
+    }
+  }
+  throw std::invalid_argument("corrupted varint");
+}
+
+void check_options(encode_options const& options) {
+  if (options.block_size < MIN_BLOCK_SIZE ||
+      options.block_size > MAX_BLOCK_SIZE) {
+    throw std::invalid_argument("block size out of range");
+  }
+  if (options.code_length_limit < MIN_CODE_LENGTH_LIMIT ||
+      options.code_length_limit > MAX_CODE_LENGTH_LIMIT) {
+    throw std::invalid_argument("code length limit out of range");
+  }
+  if (!(options.sample_fraction > 0 && options.sample_fraction <= 1)) {
+    throw std::invalid_argument("sample fraction out of range");
+  }
+}
+
+void check_options(decode_options const& options) {
+  if (options.table_bits < MIN_TABLE_BITS ||
+      options.table_bits > MAX_TABLE_BITS) {
+    throw std::invalid_argument("table bits out of range");
+  }
+}
+
+uint8_t stream_flags(encode_options const& options) {
+  return (options.checksums ? FLAG_CHECKSUMS : 0) |
+         (options.index ? FLAG_INDEX : 0);
+}
+
+char* write_stream_header(char* out, uint8_t flags) {
+  out = std::copy(MAGIC.begin(), MAGIC.end(), out);
+  *out++ = static_cast<char>(FORMAT_VERSION);
+  *out++ = static_cast<char>(flags);
+  return out;
+}
+
+bool has_magic(char const* data) {
+  return std::equal(MAGIC.begin(), MAGIC.end(), data,
+                    [](unsigned char a, char b) {
+                      return a == static_cast<unsigned char>(b);
+                    });
+}
+
+struct stream_format {
+  uint8_t version;
+  uint8_t flags;
+};
+
+// checks version and flags following the magic
+stream_format check_stream_header(char const* header) {
+  stream_format format{static_cast<uint8_t>(header[0]),
+                       static_cast<uint8_t>(header[1])};
+  if (format.version == 0 || format.version > FORMAT_VERSION ||
+      (format.flags & ~KNOWN_FLAGS) != 0 ||
+      (format.version == 1 && format.flags != 0)) {
+    throw std::invalid_argument("unsupported format version");
+  }
+  return format;
+}
+
+// number of bits needed for val
+size_t bit_width(size_t val) {
+  size_t width{0};
+  for (; val > 0; val >>= 1) {
+    width++;
+  }
+  return width;
+}
+
+// compact code lengths are the shortest length, width of differences to it,
+// bitmap of chars with codes and, for each of them, its difference, all of
+// them packed in width bits
+constexpr size_t LENGTHS_BITMAP_SIZE = 256 / 8;
+// largest difference fits in 5 bits
+constexpr size_t MAX_LENGTHS_SIZE = 2 + LENGTHS_BITMAP_SIZE + 256 * 5 / 8;
+
+size_t code_lengths_size(code_map const& codes) {
+  uint8_t min_length{std::numeric_limits<uint8_t>::max()};
+  uint8_t max_length{0};
+  size_t n{0};
+  for (code const& c : codes) {
+    if (c.length > 0) {
+      min_length = std::min(min_length, c.length);
+      max_length = std::max(max_length, c.length);
+      n++;
+    }
+  }
+  size_t width{n == 0 ? 0 : bit_width(max_length - min_length)};
+  return 2 + LENGTHS_BITMAP_SIZE + (n * width + 7) / 8;
+}
+
+// writes code_lengths_size(codes) bytes
+char* write_code_lengths(char* out, code_map const& codes) {
+  uint8_t min_length{std::numeric_limits<uint8_t>::max()};
+  uint8_t max_length{0};
+  for (code const& c : codes) {
+    if (c.length > 0) {
+      min_length = std::min(min_length, c.length);
+      max_length = std::max(max_length, c.length);
+    }
+  }
+  if (max_length == 0) {
+    min_length = 0;
+  }
+  size_t width{bit_width(max_length - min_length)};
+  *out++ = static_cast<char>(min_length);
+  *out++ = static_cast<char>(width);
+  std::fill_n(out, LENGTHS_BITMAP_SIZE, 0);
+  for (size_t i = 0; i < codes.size(); i++) {
+    if (codes[i].length > 0) {
+      out[i / 8] = static_cast<char>(out[i / 8] | 1 << (i % 8));
+    }
+  }
+  out += LENGTHS_BITMAP_SIZE;
+  uint32_t buff{0};
+  size_t buff_len{0};
+  for (code const& c : codes) {
+    if (c.length == 0) {
+      continue;
+    }
+    buff = buff << width | static_cast<uint32_t>(c.length - min_length);
+    buff_len += width;
+    if (buff_len >= 8) {
+      buff_len -= 8;
+      *out++ = static_cast<char>(buff >> buff_len);
+    }
+  }
+  if (buff_len > 0) {
+    *out++ = static_cast<char>(buff << (8 - buff_len));
+  }
+  return out;
+}
+
+// reads code lengths stored by the given format version, returns position
+// after them
+char const* read_code_lengths(char const* first, char const* last,
+                              code_map& codes, uint8_t version) {
+  if (version == 1) {
+    if (static_cast<size_t>(last - first) < codes.size()) {
+      throw std::invalid_argument("corrupted block header");
+    }
+    for (code& c : codes) {
+      c.length = static_cast<uint8_t>(*first++);
+    }
+    return first;
+  }
+  if (static_cast<size_t>(last - first) < 2 + LENGTHS_BITMAP_SIZE) {
+    throw std::invalid_argument("corrupted block header");
+  }
+  uint8_t min_length{static_cast<uint8_t>(first[0])};
+  size_t width{static_cast<uint8_t>(first[1])};
+  if (min_length > MAX_CODE_LENGTH_LIMIT || width > 5) {
+    throw std::invalid_argument("corrupted block header");
+  }
+  char const* bitmap = first + 2;
+  first = bitmap + LENGTHS_BITMAP_SIZE;
+  uint32_t buff{0};
+  size_t buff_len{0};
+  for (size_t i = 0; i < codes.size(); i++) {
+    if ((static_cast<unsigned char>(bitmap[i / 8]) >> (i % 8) & 1) == 0) {
+      codes[i].length = 0;
+      continue;
+    }
+    if (buff_len < width) {
+      if (first == last) {
+        throw std::invalid_argument("corrupted block header");
+      }
+      buff = buff << 8 | static_cast<unsigned char>(*first++);
+      buff_len += 8;
+    }
+    buff_len -= width;
+    uint32_t diff{(buff >> buff_len) & ((uint32_t{1} << width) - 1)};
+    codes[i].length = static_cast<uint8_t>(min_length + diff);
+    if (codes[i].length == 0) {
+      throw std::invalid_argument("corrupted block header");
+    }
+  }
+  return first;
+}
+
+// size of code lengths starting at first, which has to hold at least
+// 2 + LENGTHS_BITMAP_SIZE bytes for format version 2
+size_t stored_lengths_size(char const* first, uint8_t version) {
+  if (version == 1) {
+    return 256;
+  }
+  size_t chars{0};
+  for (size_t i = 0; i < LENGTHS_BITMAP_SIZE; i++) {
+    chars += std::bitset<8>(static_cast<unsigned char>(first[2 + i])).count();
+  }
+  return 2 + LENGTHS_BITMAP_SIZE +
+         (chars * static_cast<uint8_t>(first[1]) + 7) / 8;
+}
+
+// decoding tables of the code lengths seen last on this thread, found by
+// their hash and compared byte by byte, so that blocks and calls repeating
+// the same lengths skip building the table
+constexpr size_t TABLE_CACHE_SIZE = 8;
+
+struct cached_table {
+  uint32_t hash;
+  uint8_t version;
+  size_t table_bits;
+  std::vector<char> lengths;
+  std::shared_ptr<decoding_table> table;
+};
+
+// decoding tables kept by a context, or by every thread without one; their
+// memory is reused for new tables once nothing else refers to them
+struct table_scratch {
+  // of the last few distinct code lengths, most recently used first
+  std::vector<cached_table> cache;
+  // of the current context block
+  std::vector<decoding_table> context_tables;
+};
+
+table_scratch& thread_tables() {
+  thread_local table_scratch tables;
+  return tables;
+}
+
+// reads code lengths at first of format version, first is moved past them
+std::shared_ptr<decoding_table const> get_table(char const*& first,
+                                                char const* last,
+                                                uint8_t version,
+                                                size_t table_bits,
+                                                table_scratch& tables,
+                                                stats* s) {
+  phase_timer timer(s, &stats::decoding_tables);
+  size_t n{version == 1 ? size_t{256} : 2 + LENGTHS_BITMAP_SIZE};
+  if (static_cast<size_t>(last - first) >= n) {
+    n = stored_lengths_size(first, version);
+  }
+  if (static_cast<size_t>(last - first) < n) {
+    throw std::invalid_argument("corrupted block header");
+  }
+  uint32_t hash{checksum(reinterpret_cast<uint8_t const*>(first), n)};
+  std::vector<cached_table>& cache = tables.cache;
+  for (auto it = cache.begin(); it != cache.end(); ++it) {
+    if (it->hash == hash && it->version == version &&
+        it->table_bits == table_bits && it->lengths.size() == n &&
+        std::equal(first, first + n, it->lengths.begin())) {
+      std::rotate(cache.begin(), it, it + 1);
+      first += n;
+      if (s) {
+        s->reused_tables++;
+      }
+      return cache.front().table;
+    }
+  }
+  code_map codes{};
+  read_code_lengths(first, first + n, codes, version);
+  cached_table entry{hash, version, table_bits, {}, nullptr};
+  if (cache.size() == TABLE_CACHE_SIZE) {
+    entry.lengths = std::move(cache.back().lengths);
+    entry.table = std::move(cache.back().table);
+    cache.pop_back();
+  }
+  if (entry.table && entry.table.use_count() == 1) {
+    entry.table->build(codes, table_bits);
+  } else {
+    entry.table = std::make_shared<decoding_table>(codes, table_bits);
+  }
+  // all stored lengths fit in the memory of the longest ones, of version 1
+  entry.lengths.reserve(256);
+  entry.lengths.assign(first, first + n);
+  cache.insert(cache.begin(), std::move(entry));
+  first += n;
+  return cache.front().table;
+}
+
+// interleaved payload stores sizes of all the streams but the last one
+constexpr size_t JUMP_TABLE_SIZE = 4 * (INTERLEAVED_STREAMS - 1);
+
+// context payload starts with the table index of every context, followed by
+// code lengths of every table and a single stream; contexts are clustered to
+// share tables, so that the header stays small and all the decoding tables
+// fit in cache
+using context_map = std::array<uint8_t, 256>;
+constexpr size_t MAX_CONTEXT_TABLES = 32;
+
+// bwt payload starts with the row of the block in the transform and the
+// number of move-to-front symbols
+constexpr size_t BWT_HEADER_SIZE = 8;
+
+// context of the first char of a block
+size_t initial_context() {
+  return char_to_ind('\0');
+}
+
+struct block_header {
+  block_type type;
+  size_t size;
+  size_t payload_size;
+  uint32_t checksum;
+};
+
+// header is the block type followed by the sizes and, if the stream has
+// checksums, by the checksum
+block_header read_block_header(char const* header, uint8_t flags) {
+  block_type type{static_cast<block_type>(header[0])};
+  block_header result{type, read_le32(header + 1), read_le32(header + 5), 0};
+  if (flags & FLAG_CHECKSUMS) {
+    result.checksum = read_le32(header + BLOCK_HEADER_SIZE);
+  }
+  // optimal code never takes more than 8 bits per char
+  size_t max_payload_size{std::max(size_t{256}, MAX_LENGTHS_SIZE) + result.size};
+  switch (type) {
+  case block_type::huffman:
+    break;
+  case block_type::interleaved:
+    max_payload_size += JUMP_TABLE_SIZE;
+    break;
+  case block_type::raw:
+    max_payload_size = result.size;
+    break;
+  case block_type::run:
+    max_payload_size = 1;
+    break;
+  case block_type::context:
+    max_payload_size = std::tuple_size_v<context_map> +
+                       MAX_CONTEXT_TABLES * MAX_LENGTHS_SIZE + result.size;
+    break;
+  case block_type::bwt:
+    max_payload_size += BWT_HEADER_SIZE;
+    break;
+  default:
+    throw std::invalid_argument("unknown block type");
+  }
+  if (result.size > MAX_BLOCK_SIZE || result.payload_size > max_payload_size ||
+      ((type == block_type::raw || type == block_type::run) &&
+       result.payload_size != max_payload_size)) {
+    throw std::invalid_argument("corrupted block header");
+  }
+  return result;
+}
+
+// tables of a context block and the table of every context
+struct context_code {
+  context_map contexts;
+  std::vector<code_map> codes;
+};
+
+// contexts rarer than that start in a shared cluster, as well as those
+// beyond the most frequent ones
+constexpr size_t MIN_CONTEXT_COUNT = 64;
+constexpr size_t MAX_CONTEXT_CANDIDATES = 64;
+
+// estimated bits of chars coded by the code of their counts, with its
+// compact code lengths
+double code_cost(count_map const& count) {
+  size_t total{0};
+  size_t n{0};
+  double sum{0};
+  for (size_t c : count) {
+    if (c > 0) {
+      total += c;
+      n++;
+      sum += c * std::log2(static_cast<double>(c));
+    }
+  }
+  if (total == 0) {
+    return 0;
+  }
+  return total * std::log2(static_cast<double>(total)) - sum +
+         8 * (2 + LENGTHS_BITMAP_SIZE) + 4 * n;
+}
+
+// clusters contexts by merging the pair of clusters that costs the least
+// with a shared table, while sharing saves bits or there are too many
+context_code build_context_code(std::vector<count_map> const& context_count,
+                                size_t length_limit, stats* s) {
+  struct cluster {
+    count_map count;
+    double cost;
+    std::vector<size_t> contexts;
+  };
+  std::vector<cluster> clusters;
+  std::array<size_t, 256> totals{};
+  std::vector<size_t> order;
+  for (size_t i = 0; i < context_count.size(); i++) {
+    totals[i] = std::accumulate(context_count[i].begin(),
+                                context_count[i].end(), size_t{0});
+    if (totals[i] > 0) {
+      order.push_back(i);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&totals](size_t i, size_t j) { return totals[i] > totals[j]; });
+  cluster rare{};
+  for (size_t k = 0; k < order.size(); k++) {
+    size_t i{order[k]};
+    if (k < MAX_CONTEXT_CANDIDATES && totals[i] >= MIN_CONTEXT_COUNT) {
+      clusters.push_back({context_count[i], code_cost(context_count[i]), {i}});
+      continue;
+    }
+    for (size_t j = 0; j < rare.count.size(); j++) {
+      rare.count[j] += context_count[i][j];
+    }
+    rare.contexts.push_back(i);
+  }
+  if (!rare.contexts.empty()) {
+    rare.cost = code_cost(rare.count);
+    clusters.push_back(std::move(rare));
+  }
+
+  phase_timer timer(s, &stats::code_lengths);
+  size_t n{clusters.size()};
+  auto merge_cost = [&clusters](size_t i, size_t j) {
+    count_map count{clusters[i].count};
+    for (size_t k = 0; k < count.size(); k++) {
+      count[k] += clusters[j].count[k];
+    }
+    return code_cost(count) - clusters[i].cost - clusters[j].cost;
+  };
+  std::vector<double> delta(n * n);
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = i + 1; j < n; j++) {
+      delta[i * n + j] = merge_cost(i, j);
+    }
+  }
+  std::vector<bool> merged(n, false);
+  for (size_t left = n; left > 1; left--) {
+    size_t best_i{0};
+    size_t best_j{0};
+    double best{std::numeric_limits<double>::max()};
+    for (size_t i = 0; i < n; i++) {
+      for (size_t j = i + 1; j < n && !merged[i]; j++) {
+        if (!merged[j] && delta[i * n + j] < best) {
+          best = delta[i * n + j];
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+    if (best >= 0 && left <= MAX_CONTEXT_TABLES) {
+      break;
+    }
+    cluster& c = clusters[best_i];
+    for (size_t k = 0; k < c.count.size(); k++) {
+      c.count[k] += clusters[best_j].count[k];
+    }
+    c.cost = code_cost(c.count);
+    c.contexts.insert(c.contexts.end(), clusters[best_j].contexts.begin(),
+                      clusters[best_j].contexts.end());
+    merged[best_j] = true;
+    for (size_t k = 0; k < n; k++) {
+      if (!merged[k] && k != best_i) {
+        delta[std::min(k, best_i) * n + std::max(k, best_i)] =
+            merge_cost(std::min(k, best_i), std::max(k, best_i));
+      }
+    }
+  }
+
+  // contexts that never occur keep table 0
+  context_code result{};
+  for (size_t i = 0; i < n; i++) {
+    if (merged[i]) {
+      continue;
+    }
+    for (size_t context : clusters[i].contexts) {
+      result.contexts[context] = static_cast<uint8_t>(result.codes.size());
+    }
+    result.codes.push_back(build_code_lengths(clusters[i].count, length_limit));
+  }
+  return result;
+}
+
+struct block_code {
+  block_type type;
+  code_map codes;
+  size_t payload_size;
+  // only the first one is used by a single stream block
+  std::array<size_t, INTERLEAVED_STREAMS> stream_sizes;
+  uint32_t checksum;
+  context_code context;
+  // move-to-front symbols of a bwt block, coded in place of its chars
+  std::vector<char> symbols;
+  uint32_t primary;
+  // codes are built from sampled counts, so payload_size only reserves space
+  // and the streams are measured as they are written
+  bool sampled;
+};
+
+// bwt block of [first, last)
+block_code choose_bwt_code(char const* first, char const* last,
+                           encode_options const& options, stats* s) {
+  block_code result{block_type::bwt, {}, 0, {}, 0, {}, {}, 0};
+  {
+    phase_timer timer(s, &stats::transform);
+    std::vector<char> transformed(last - first);
+    result.primary = detail::bwt_forward(first, last, transformed.data());
+    result.symbols.reserve(transformed.size());
+    detail::mtf_encode(transformed.data(),
+                       transformed.data() + transformed.size(),
+                       result.symbols);
+  }
+  count_map count{};
+  {
+    phase_timer timer(s, &stats::histogram);
+    count_occurrences(result.symbols.data(),
+                      result.symbols.data() + result.symbols.size(), count);
+  }
+  {
+    phase_timer timer(s, &stats::code_lengths);
+    result.codes = build_code_lengths(count, options.code_length_limit);
+  }
+  {
+    phase_timer timer(s, &stats::canonical_codes);
+    fill_canonical_code_values(result.codes);
+  }
+  result.stream_sizes[0] = (message_length(count, result.codes) + 7) / 8;
+  result.payload_size =
+      BWT_HEADER_SIZE + code_lengths_size(result.codes) + result.stream_sizes[0];
+  return result;
+}
+
+// context block of [first, last)
+block_code choose_context_code(char const* first, char const* last,
+                               encode_options const& options, stats* s) {
+  std::vector<count_map> context_count(256);
+  {
+    phase_timer timer(s, &stats::histogram);
+    size_t context{initial_context()};
+    for (; first != last; ++first) {
+      size_t ch{char_to_ind(*first)};
+      context_count[context][ch]++;
+      context = ch;
+    }
+  }
+  block_code result{block_type::context, {}, 0, {}, 0, {}};
+  result.context =
+      build_context_code(context_count, options.code_length_limit, s);
+  {
+    phase_timer timer(s, &stats::canonical_codes);
+    for (code_map& codes : result.context.codes) {
+      fill_canonical_code_values(codes);
+    }
+  }
+  size_t bits{0};
+  for (size_t i = 0; i < context_count.size(); i++) {
+    bits += message_length(context_count[i],
+                           result.context.codes[result.context.contexts[i]]);
+  }
+  result.stream_sizes[0] = (bits + 7) / 8;
+  result.payload_size = std::tuple_size_v<context_map> + result.stream_sizes[0];
+  for (code_map const& codes : result.context.codes) {
+    result.payload_size += code_lengths_size(codes);
+  }
+  return result;
+}
+
+constexpr size_t SAMPLE_PIECE_SIZE = size_t{4} << 10;
+
+// counts chars of pieces spread over [first, last) by the sample fraction of
+// options, returns their size; counts nothing and returns 0 when the pieces
+// would cover the whole range
+size_t count_sample(char const* first, char const* last,
+                    encode_options const& options, count_map& count) {
+  size_t size{static_cast<size_t>(last - first)};
+  size_t pieces{static_cast<size_t>(
+      std::ceil(options.sample_fraction * size / SAMPLE_PIECE_SIZE))};
+  if (pieces * SAMPLE_PIECE_SIZE >= size) {
+    return 0;
+  }
+  size_t stride{size / pieces};
+  // xorshift seeded by the size, so that output doesn't change between runs
+  uint64_t random{0x9E3779B97F4A7C15 ^ size};
+  for (size_t i = 0; i < pieces; i++) {
+    size_t offset{0};
+    if (options.random_sampling) {
+      random ^= random << 13;
+      random ^= random >> 7;
+      random ^= random << 17;
+      offset = random % (stride - SAMPLE_PIECE_SIZE + 1);
+    }
+    char const* piece = first + i * stride + offset;
+    count_occurrences(piece, piece + SAMPLE_PIECE_SIZE, count);
+  }
+  return pieces * SAMPLE_PIECE_SIZE;
+}
+
+// scales counts of sampled chars to size chars, the others get the least
+// count, so that every char has a code
+void scale_sample(count_map& count, size_t sampled, size_t size) {
+  for (size_t& c : count) {
+    c = std::max<size_t>(c * size / sampled, 1);
+  }
+}
+
+// picks the shortest block type for [first, last), counted if set holds
+// counts of all its chars
+block_code choose_block_code(char const* first, char const* last,
+                             encode_options const& options, stats* s,
+                             count_map const* counted) {
+  size_t streams{options.interleaved ? INTERLEAVED_STREAMS : 1};
+  size_t size{static_cast<size_t>(last - first)};
+  // streams are counted apart to know their sizes
+  std::array<count_map, INTERLEAVED_STREAMS> stream_count{};
+  count_map count{};
+  size_t sampled{0};
+  if (counted && streams == 1) {
+    count = *counted;
+    stream_count[0] = *counted;
+  } else {
+    phase_timer timer(s, &stats::histogram);
+    if (options.sample_fraction < 1) {
+      sampled = count_sample(first, last, options, count);
+    }
+    for (size_t i = 0; i < streams && sampled == 0; i++) {
+      size_t stream_first{streams == 1 ? 0 : stream_start(size, i)};
+      size_t stream_last{streams == 1 ? size : stream_start(size, i + 1)};
+      count_occurrences(first + stream_first, first + stream_last,
+                        stream_count[i]);
+      for (size_t j = 0; j < count.size(); j++) {
+        count[j] += stream_count[i][j];
+      }
+    }
+  }
+  // a sample of a single char is checked to be a run, since raw blocks are
+  // not much longer than the code of a char in a single bit
+  if (std::count(count.begin(), count.end(), size_t{0}) ==
+          static_cast<ptrdiff_t>(count.size() - 1) &&
+      (sampled == 0 || std::find_if(first, last, [first](char ch) {
+                         return ch != *first;
+                       }) == last)) {
+    return {block_type::run, {}, 1, {}, 0};
+  }
+  if (sampled > 0) {
+    scale_sample(count, sampled, size);
+  }
+  block_code result{block_type::huffman, {}, 0, {}, 0};
+  {
+    phase_timer timer(s, &stats::code_lengths);
+    result.codes = build_code_lengths(count, options.code_length_limit);
+  }
+  {
+    phase_timer timer(s, &stats::canonical_codes);
+    fill_canonical_code_values(result.codes);
+  }
+  result.payload_size = code_lengths_size(result.codes);
+  if (options.interleaved) {
+    result.type = block_type::interleaved;
+    result.payload_size += JUMP_TABLE_SIZE;
+  }
+  if (sampled > 0) {
+    // estimated by the scaled counts, at most a byte of padding per stream
+    result.payload_size += (message_length(count, result.codes) + 7) / 8;
+    result.payload_size += streams - 1;
+  }
+  for (size_t i = 0; i < streams && sampled == 0; i++) {
+    result.stream_sizes[i] =
+        (message_length(stream_count[i], result.codes) + 7) / 8;
+    result.payload_size += result.stream_sizes[i];
+  }
+  if (options.order1) {
+    block_code context{choose_context_code(first, last, options, s)};
+    if (context.payload_size < result.payload_size) {
+      result = std::move(context);
+      streams = 1;
+    }
+  }
+  if (options.bwt) {
+    block_code bwt{choose_bwt_code(first, last, options, s)};
+    if (bwt.payload_size < result.payload_size) {
+      result = std::move(bwt);
+      streams = 1;
+    }
+  }
+  result.sampled = sampled > 0 && (result.type == block_type::huffman ||
+                                   result.type == block_type::interleaved);
+  // copying is faster to decode, when it isn't longer; codes fit their own
+  // sample better than the block, so sampled estimates need a margin
+  if (result.payload_size + (result.sampled ? size / 32 : 0) >= size) {
+    return {block_type::raw, {}, size, {}, 0};
+  }
+  if (result.sampled) {
+    // space of a raw block, which is written when the streams don't fit
+    result.payload_size = size;
+    return result;
+  }
+  if (s) {
+    s->coded_chars += size;
+    for (size_t i = 0; i < streams; i++) {
+      s->code_bits += 8 * result.stream_sizes[i];
+    }
+  }
+  return result;
+}
+
+// s collects stats of this block only, if set
+block_code build_block_code(char const* first, char const* last,
+                            encode_options const& options, stats* s,
+                            count_map const* counted = nullptr) {
+  block_code result{choose_block_code(first, last, options, s, counted)};
+  if (s) {
+    s->blocks++;
+  }
+  if (options.checksums) {
+    phase_timer timer(s, &stats::checksums);
+    result.checksum = checksum(reinterpret_cast<uint8_t const*>(first),
+                               last - first);
+  }
+  return result;
+}
+
+// adaptive blocks start at multiples of that
+constexpr size_t SPLIT_PIECE_SIZE = size_t{16} << 10;
+
+// blocks a chunk of input is coded as
+struct chunk_split {
+  // relative to the chunk start
+  std::vector<size_t> ends;
+  // counts of chars of every block, if they are known
+  std::vector<count_map> counts;
+
+  count_map const* counts_of(size_t i) const {
+    return counts.empty() ? nullptr : &counts[i];
+  }
+};
+
+// splits [first, last) into blocks. With options.adaptive it's split into
+// pieces, and adjacent blocks of them whose shared table costs the least are
+// merged, while that saves more bits than their own tables and block header
+// cost; the counts are kept for the codes.
+void split_blocks(char const* first, char const* last,
+                  encode_options const& options, chunk_split& split,
+                  stats* s) {
+  size_t size{static_cast<size_t>(last - first)};
+  split.ends.clear();
+  split.counts.clear();
+  if (!options.adaptive || size <= SPLIT_PIECE_SIZE) {
+    split.ends.push_back(size);
+    return;
+  }
+  phase_timer timer(s, &stats::histogram);
+  size_t pieces{(size + SPLIT_PIECE_SIZE - 1) / SPLIT_PIECE_SIZE};
+  // counts and cost of every block are kept at its first piece
+  std::vector<count_map> counts(pieces);
+  std::vector<double> costs(pieces);
+  double header_bits{8.0 * block_header_size(stream_flags(options))};
+  for (size_t i = 0; i < pieces; i++) {
+    count_occurrences(first + i * SPLIT_PIECE_SIZE,
+                      first + std::min(size, (i + 1) * SPLIT_PIECE_SIZE),
+                      counts[i]);
+    costs[i] = code_cost(counts[i]) + header_bits;
+  }
+  std::vector<size_t> blocks(pieces);
+  std::iota(blocks.begin(), blocks.end(), size_t{0});
+  // merged[i] is the cost of blocks i and i + 1 as one
+  auto merged_cost = [&](size_t i) {
+    count_map count{counts[blocks[i]]};
+    for (size_t j = 0; j < count.size(); j++) {
+      count[j] += counts[blocks[i + 1]][j];
+    }
+    return code_cost(count) + header_bits;
+  };
+  std::vector<double> merged(pieces - 1);
+  for (size_t i = 0; i + 1 < pieces; i++) {
+    merged[i] = merged_cost(i);
+  }
+  while (!merged.empty()) {
+    size_t best{0};
+    double best_saving{-1};
+    for (size_t i = 0; i < merged.size(); i++) {
+      double saving{costs[blocks[i]] + costs[blocks[i + 1]] - merged[i]};
+      if (saving > best_saving) {
+        best = i;
+        best_saving = saving;
+      }
+    }
+    if (best_saving < 0) {
+      break;
+    }
+    count_map& count = counts[blocks[best]];
+    for (size_t j = 0; j < count.size(); j++) {
+      count[j] += counts[blocks[best + 1]][j];
+    }
+    costs[blocks[best]] = merged[best];
+    blocks.erase(blocks.begin() + best + 1);
+    merged.erase(merged.begin() + best);
+    if (best > 0) {
+      merged[best - 1] = merged_cost(best - 1);
+    }
+    if (best < merged.size()) {
+      merged[best] = merged_cost(best);
+    }
+  }
+  for (size_t i = 0; i < blocks.size(); i++) {
+    split.ends.push_back(i + 1 < blocks.size()
+                             ? blocks[i + 1] * SPLIT_PIECE_SIZE
+                             : size);
+    split.counts.push_back(counts[blocks[i]]);
+  }
+}
+
+size_t encoded_size(block_code const& block, uint8_t flags) {
+  return block_header_size(flags) + block.payload_size;
+}
+
+char* write_block_header(char* out, block_type type, size_t size,
+                         size_t payload_size, uint32_t checksum,
+                         uint8_t flags) {
+  *out++ = static_cast<char>(type);
+  out = write_le32(out, static_cast<uint32_t>(size));
+  out = write_le32(out, static_cast<uint32_t>(payload_size));
+  if (flags & FLAG_CHECKSUMS) {
+    out = write_le32(out, checksum);
+  }
+  return out;
+}
+
+// Huffman block of sampled codes, whose streams are written within the
+// space reserved for a raw block, which is written instead if they don't fit
+char* write_sampled_block(char const* first, char const* last,
+                          block_code const& block, uint8_t flags, char* out,
+                          stats* s) {
+  size_t size{static_cast<size_t>(last - first)};
+  size_t streams{block.type == block_type::interleaved ? INTERLEAVED_STREAMS
+                                                       : 1};
+  char* payload = out + block_header_size(flags);
+  char* payload_end = payload + size;
+  std::array<size_t, INTERLEAVED_STREAMS> stream_sizes{};
+  bool fits{true};
+  char* p = write_code_lengths(payload, block.codes);
+  char* jump_table = p;
+  {
+    phase_timer timer(s, &stats::bit_packing);
+    if (streams > 1) {
+      p += JUMP_TABLE_SIZE;
+    }
+    uint8_t max_length{max_code_length(block.codes)};
+    for (size_t i = 0; i < streams && fits; i++) {
+      bit_writer writer(p);
+      fits = put_chars<true>(
+          writer, first + (streams == 1 ? 0 : stream_start(size, i)),
+          first + (streams == 1 ? size : stream_start(size, i + 1)),
+          block.codes, max_length, payload_end);
+      if (fits) {
+        char* stream_end = writer.finish();
+        stream_sizes[i] = stream_end - p;
+        p = stream_end;
+      }
+    }
+  }
+  if (!fits) {
+    out = write_block_header(out, block_type::raw, size, size, block.checksum,
+                             flags);
+    return std::copy(first, last, out);
+  }
+  for (size_t i = 0; i + 1 < streams; i++) {
+    jump_table = write_le32(jump_table, static_cast<uint32_t>(stream_sizes[i]));
+  }
+  write_block_header(out, block.type, size, p - payload, block.checksum, flags);
+  if (s) {
+    s->coded_chars += size;
+    for (size_t i = 0; i < streams; i++) {
+      s->code_bits += 8 * stream_sizes[i];
+    }
+  }
+  return p;
+}
+
+// writes encoded_size(block, flags) bytes to out, or fewer for sampled codes;
+// returns the end of the block
+char* write_block(char const* first, char const* last, block_code const& block,
+                  uint8_t flags, char* out, stats* s) {
+  if (block.sampled) {
+    return write_sampled_block(first, last, block, flags, out, s);
+  }
+  size_t size{static_cast<size_t>(last - first)};
+  out = write_block_header(out, block.type, size, block.payload_size,
+                           block.checksum, flags);
+  if (block.type == block_type::raw) {
+    return std::copy(first, last, out);
+  }
+  if (block.type == block_type::run) {
+    *out++ = *first;
+    return out;
+  }
+  phase_timer timer(s, &stats::bit_packing);
+  if (block.type == block_type::context) {
+    context_code const& context = block.context;
+    uint8_t max_length{0};
+    for (uint8_t i : context.contexts) {
+      *out++ = static_cast<char>(i);
+    }
+    for (code_map const& codes : context.codes) {
+      out = write_code_lengths(out, codes);
+      max_length = std::max(max_length, max_code_length(codes));
+    }
+    bit_writer writer(out);
+    size_t cur{initial_context()};
+    put_codes(
+        writer, first, last,
+        [&context, &cur](char ch) -> code const& {
+          code const& c = context.codes[context.contexts[cur]][char_to_ind(ch)];
+          cur = char_to_ind(ch);
+          return c;
+        },
+        max_length, out + block.stream_sizes[0]);
+    return writer.finish();
+  }
+  if (block.type == block_type::bwt) {
+    out = write_le32(out, block.primary);
+    out = write_le32(out, static_cast<uint32_t>(block.symbols.size()));
+    out = write_code_lengths(out, block.codes);
+    bit_writer writer(out);
+    put_chars(writer, block.symbols.data(),
+              block.symbols.data() + block.symbols.size(), block.codes,
+              max_code_length(block.codes), out + block.stream_sizes[0]);
+    return writer.finish();
+  }
+  out = write_code_lengths(out, block.codes);
+  uint8_t max_length{max_code_length(block.codes)};
+  if (block.type == block_type::huffman) {
+    bit_writer writer(out);
+    put_chars(writer, first, last, block.codes, max_length,
+              out + block.stream_sizes[0]);
+    return writer.finish();
+  }
+  for (size_t i = 0; i + 1 < INTERLEAVED_STREAMS; i++) {
+    out = write_le32(out, static_cast<uint32_t>(block.stream_sizes[i]));
+  }
+  for (size_t i = 0; i < INTERLEAVED_STREAMS; i++) {
+    bit_writer writer(out);
+    put_chars(writer, first + stream_start(size, i),
+              first + stream_start(size, i + 1), block.codes, max_length,
+              out + block.stream_sizes[i]);
+    out = writer.finish();
+  }
+  return out;
+}
+
+// decodes the rest of a byte padded stream, which has to fill the output
+void finish_stream(decoding_table const& table,
+                   bit_reader<char const*>& reader, char* out, char* out_end) {
+  // only the padding of the last byte can be left
+  if (table.decode(reader, out, out_end, 0) != out_end || !reader.exhausted() ||
+      reader.buff.length >= 8) {
+    throw std::invalid_argument("corrupted input message");
+  }
+}
+
+void decode_context(char const* first, char const* last, size_t size,
+                    uint8_t version, char* out, size_t table_bits,
+                    table_scratch& scratch, stats* s) {
+  context_map contexts;
+  std::vector<decoding_table>& tables = scratch.context_tables;
+  {
+    phase_timer timer(s, &stats::decoding_tables);
+    if (static_cast<size_t>(last - first) < contexts.size()) {
+      throw std::invalid_argument("corrupted block header");
+    }
+    size_t n{0};
+    for (uint8_t& i : contexts) {
+      i = static_cast<uint8_t>(*first++);
+      n = std::max(n, size_t{i} + 1);
+    }
+    if (n > MAX_CONTEXT_TABLES) {
+      throw std::invalid_argument("corrupted block header");
+    }
+    // tables past n are left from earlier blocks
+    for (size_t i = 0; i < n; i++) {
+      code_map codes{};
+      first = read_code_lengths(first, last, codes, version);
+      if (i < tables.size()) {
+        tables[i].build(codes, table_bits);
+      } else {
+        tables.emplace_back(codes, table_bits);
+      }
+    }
+  }
+  phase_timer timer(s, &stats::decoding);
+  // table of the next char depends on this one, so chars are decoded one by
+  // one, each with checks of the bits left
+  bit_reader<char const*> reader(first, last);
+  size_t context{initial_context()};
+  for (char* out_end = out + size; out != out_end; ++out) {
+    context = tables[contexts[context]].decode_char(reader, reader.buff.length);
+    *out = ind_to_char(context);
+  }
+  if (!reader.exhausted() || reader.buff.length >= 8) {
+    throw std::invalid_argument("corrupted input message");
+  }
+  if (s) {
+    s->coded_chars += size;
+    s->code_bits += 8 * static_cast<uint64_t>(last - first);
+    s->slow_path_chars += reader.long_codes;
+  }
+}
+
+// every move-to-front symbol takes at most 2 bytes
+void decode_bwt(char const* first, char const* last, size_t size,
+                uint8_t version, char* out, size_t table_bits,
+                table_scratch& tables, stats* s) {
+  if (static_cast<size_t>(last - first) < BWT_HEADER_SIZE) {
+    throw std::invalid_argument("corrupted block header");
+  }
+  uint32_t primary{read_le32(first)};
+  size_t symbols_size{read_le32(first + 4)};
+  if (symbols_size > 2 * size) {
+    throw std::invalid_argument("corrupted block header");
+  }
+  first += BWT_HEADER_SIZE;
+  std::shared_ptr<decoding_table const> table{
+      get_table(first, last, version, table_bits, tables, s)};
+  std::vector<char> symbols(symbols_size);
+  {
+    phase_timer timer(s, &stats::decoding);
+    bit_reader<char const*> reader(first, last);
+    finish_stream(*table, reader, symbols.data(),
+                  symbols.data() + symbols.size());
+    if (s) {
+      s->coded_chars += size;
+      s->code_bits += 8 * static_cast<uint64_t>(last - first);
+      s->slow_path_chars += reader.long_codes;
+    }
+  }
+  phase_timer timer(s, &stats::transform);
+  std::vector<char> transformed(size);
+  detail::mtf_decode(symbols.data(), symbols.data() + symbols.size(),
+                     transformed.data(), transformed.data() + size);
+  detail::bwt_inverse(transformed.data(), transformed.data() + size, primary,
+                      out);
+}
+
+void decode_payload(char const* first, block_header const& header,
+                    uint8_t version, char* out, size_t table_bits,
+                    table_scratch& tables, stats* s) {
+  char const* last = first + header.payload_size;
+  if (header.type == block_type::raw) {
+    std::copy(first, last, out);
+    return;
+  }
+  if (header.type == block_type::run) {
+    std::fill_n(out, header.size, *first);
+    return;
+  }
+  if (header.type == block_type::context) {
+    decode_context(first, last, header.size, version, out, table_bits, tables,
+                   s);
+    return;
+  }
+  if (header.type == block_type::bwt) {
+    decode_bwt(first, last, header.size, version, out, table_bits, tables, s);
+    return;
+  }
+  std::shared_ptr<decoding_table const> table{
+      get_table(first, last, version, table_bits, tables, s)};
+  phase_timer timer(s, &stats::decoding);
+  if (s) {
+    s->coded_chars += header.size;
+  }
+  if (header.type == block_type::huffman) {
+    bit_reader<char const*> reader(first, last);
+    finish_stream(*table, reader, out, out + header.size);
+    if (s) {
+      s->code_bits += 8 * static_cast<uint64_t>(last - first);
+      s->slow_path_chars += reader.long_codes;
+    }
+    return;
+  }
+
+  if (static_cast<size_t>(last - first) < JUMP_TABLE_SIZE) {
+    throw std::invalid_argument("corrupted block header");
+  }
+  std::array<char const*, INTERLEAVED_STREAMS + 1> bounds;
+  bounds[0] = first + JUMP_TABLE_SIZE;
+  for (size_t i = 0; i + 1 < INTERLEAVED_STREAMS; i++) {
+    size_t stream_size{read_le32(first + 4 * i)};
+    if (static_cast<size_t>(last - bounds[i]) < stream_size) {
+      throw std::invalid_argument("corrupted block header");
+    }
+    bounds[i + 1] = bounds[i] + stream_size;
+  }
+  bounds[INTERLEAVED_STREAMS] = last;
+  std::array<bit_reader<char const*>, INTERLEAVED_STREAMS> readers{
+      bit_reader<char const*>(bounds[0], bounds[1]),
+      bit_reader<char const*>(bounds[1], bounds[2]),
+      bit_reader<char const*>(bounds[2], bounds[3]),
+      bit_reader<char const*>(bounds[3], bounds[4])};
+  std::array<char*, INTERLEAVED_STREAMS> outs;
+  std::array<char*, INTERLEAVED_STREAMS> out_ends;
+  for (size_t i = 0; i < INTERLEAVED_STREAMS; i++) {
+    outs[i] = out + stream_start(header.size, i);
+    out_ends[i] = out + stream_start(header.size, i + 1);
+  }
+  table->decode_interleaved(readers, outs, out_ends);
+  for (size_t i = 0; i < INTERLEAVED_STREAMS; i++) {
+    finish_stream(*table, readers[i], outs[i], out_ends[i]);
+  }
+  if (s) {
+    s->code_bits += 8 * static_cast<uint64_t>(last - bounds[0]);
+    for (bit_reader<char const*> const& reader : readers) {
+      s->slow_path_chars += reader.long_codes;
+    }
+  }
+}
+
+// payload of header.payload_size bytes is decoded to header.size bytes at
+// out, s collects stats of this block only, if set
+void decode_block(char const* first, block_header const& header,
+                  stream_format const& format, char* out, size_t table_bits,
+                  table_scratch& tables, stats* s) {
+  decode_payload(first, header, format.version, out, table_bits, tables, s);
+  if (s) {
+    s->blocks++;
+  }
+  if (format.flags & FLAG_CHECKSUMS) {
+    phase_timer timer(s, &stats::checksums);
+    if (checksum(reinterpret_cast<uint8_t const*>(out), header.size) !=
+        header.checksum) {
+      throw std::invalid_argument("block checksum mismatch");
+    }
+  }
+}
+
+// index has an entry of encoded and decoded size for every block, followed
+// by the number of blocks and index magic
+constexpr size_t INDEX_ENTRY_SIZE = 8;
+constexpr std::array<unsigned char, 4> INDEX_MAGIC{'H', 'U', 'F', 'I'};
+constexpr size_t INDEX_FOOTER_SIZE = 4 + INDEX_MAGIC.size();
+
+struct index_entry {
+  size_t encoded_size;
+  size_t size;
+
+  bool operator==(index_entry const& other) const {
+    return encoded_size == other.encoded_size && size == other.size;
+  }
+};
+
+size_t index_size(size_t blocks) {
+  return blocks * INDEX_ENTRY_SIZE + INDEX_FOOTER_SIZE;
+}
+
+char* write_index(char* out, std::vector<index_entry> const& entries) {
+  for (index_entry const& e : entries) {
+    out = write_le32(out, static_cast<uint32_t>(e.encoded_size));
+    out = write_le32(out, static_cast<uint32_t>(e.size));
+  }
+  out = write_le32(out, static_cast<uint32_t>(entries.size()));
+  return std::copy(INDEX_MAGIC.begin(), INDEX_MAGIC.end(), out);
+}
+
+// returns the number of blocks
+size_t read_index_footer(char const* footer) {
+  if (!std::equal(INDEX_MAGIC.begin(), INDEX_MAGIC.end(), footer + 4,
+                  [](unsigned char a, char b) {
+                    return a == static_cast<unsigned char>(b);
+                  })) {
+    throw std::invalid_argument("corrupted index");
+  }
+  return read_le32(footer);
+}
+
+// [first, last) has to be exactly the index of given blocks
+void check_index(char const* first, char const* last,
+                 std::vector<index_entry> const& entries) {
+  if (static_cast<size_t>(last - first) != index_size(entries.size()) ||
+      read_index_footer(last - INDEX_FOOTER_SIZE) != entries.size()) {
+    throw std::invalid_argument("corrupted index");
+  }
+  for (index_entry const& e : entries) {
+    if (!(index_entry{read_le32(first), read_le32(first + 4)} == e)) {
+      throw std::invalid_argument("corrupted index");
+    }
+    first += INDEX_ENTRY_SIZE;
+  }
+}
+
+// block of a buffer, found by reading the headers
+struct located_block {
+  char const* payload;
+  block_header header;
+  size_t offset;
+};
+} // namespace
+
+struct huffman::detail::scratch {
+  table_scratch tables;
+  std::vector<located_block> blocks;
+  std::vector<index_entry> index;
+  chunk_split split;
+};
+
+huffman::context::context() : s(std::make_unique<detail::scratch>()) {}
+huffman::context::context(context&&) noexcept = default;
+huffman::context& huffman::context::operator=(context&&) noexcept = default;
+huffman::context::~context() = default;
+
+namespace {
+table_scratch& tables_of(huffman::context* ctx) {
+  return ctx ? ctx->scratch().tables : thread_tables();
+}
+
+// output memory: either a growing vector or a caller buffer of fixed capacity
+class output_buffer {
+public:
+  explicit output_buffer(std::vector<uint8_t>& data)
+      : data(&data), start(data.size()), used(data.size()) {}
+
+  output_buffer(uint8_t* data, size_t capacity)
+      : fixed(reinterpret_cast<char*>(data)), capacity(capacity) {}
+
+  size_t size() const {
+    return used - start;
+  }
+
+  size_t available() const {
+    return data ? std::numeric_limits<size_t>::max() : capacity - used;
+  }
+
+  // n more bytes at the end, valid till the next call to grow
+  char* grow(size_t n) {
+    if (n > available()) {
+      throw std::invalid_argument("output buffer too small");
+    }
+    used += n;
+    if (data) {
+      data->resize(used);
+      return reinterpret_cast<char*>(data->data()) + used - n;
+    }
+    return fixed + used - n;
+  }
+
+  void shrink(size_t n) {
+    used -= n;
+    if (data) {
+      data->resize(used);
+    }
+  }
+
+private:
+  std::vector<uint8_t>* data{nullptr};
+  char* fixed{nullptr};
+  size_t capacity{0};
+  size_t start{0};
+  size_t used{0};
+};
+
+void encode_buffer(char const* src, size_t size, output_buffer& dst,
+                   encode_options const& options) {
+  check_options(options);
+  uint8_t flags{stream_flags(options)};
+  write_stream_header(dst.grow(STREAM_HEADER_SIZE), flags);
+
+  std::vector<index_entry> own_index;
+  std::vector<index_entry>& index =
+      options.context ? options.context->scratch().index : own_index;
+  index.clear();
+  if (options.threads == 1) {
+    chunk_split own_split;
+    chunk_split& split =
+        options.context ? options.context->scratch().split : own_split;
+    // without a pool and batches, which small inputs spend most time on
+    for (size_t batch = 0; batch < size; batch += options.block_size) {
+      char const* chunk = src + batch;
+      split_blocks(chunk, src + std::min(size, batch + options.block_size),
+                   options, split, options.stats);
+      for (size_t i = 0; i < split.ends.size(); i++) {
+        char const* first = chunk + (i == 0 ? 0 : split.ends[i - 1]);
+        char const* last = chunk + split.ends[i];
+        block_code code{build_block_code(first, last, options, options.stats,
+                                         split.counts_of(i))};
+        size_t reserved{encoded_size(code, flags)};
+        char* out = dst.grow(reserved);
+        size_t written{static_cast<size_t>(
+            write_block(first, last, code, flags, out, options.stats) - out)};
+        dst.shrink(reserved - written);
+        if (flags & FLAG_INDEX) {
+          index.push_back({written, static_cast<size_t>(last - first)});
+        }
+      }
+    }
+  } else {
+    detail::thread_pool pool(options.threads);
+    // chunks of a batch are split into blocks, whose codes are built first,
+    // so that all of them can be written right to their place in the output
+    size_t batch_size{2 * pool.size()};
+    std::vector<chunk_split> splits(batch_size);
+    // blocks of the batch and their counts, if known
+    std::vector<std::pair<char const*, char const*>> ranges;
+    std::vector<count_map const*> range_counts;
+    std::vector<block_code> codes;
+    std::vector<size_t> offsets;
+    std::vector<char*> ends;
+    // blocks collect their stats apart, so that threads don't share them
+    std::vector<stats> block_stats;
+    auto block_stats_of = [&](size_t i) {
+      return options.stats ? &block_stats[i] : nullptr;
+    };
+    for (size_t batch = 0; batch < size; batch += batch_size * options.block_size) {
+      size_t chunks{std::min(batch_size, (size - batch + options.block_size - 1) /
+                                             options.block_size)};
+      if (options.stats) {
+        block_stats.resize(std::max(block_stats.size(), chunks));
+      }
+      pool.for_each(chunks, [&](size_t i) {
+        split_blocks(src + batch + i * options.block_size,
+                     src + std::min(size, batch + (i + 1) * options.block_size),
+                     options, splits[i], block_stats_of(i));
+      });
+      ranges.clear();
+      range_counts.clear();
+      for (size_t i = 0; i < chunks; i++) {
+        char const* chunk = src + batch + i * options.block_size;
+        for (size_t j = 0; j < splits[i].ends.size(); j++) {
+          ranges.emplace_back(chunk + (j == 0 ? 0 : splits[i].ends[j - 1]),
+                              chunk + splits[i].ends[j]);
+          range_counts.push_back(splits[i].counts_of(j));
+        }
+      }
+      size_t blocks{ranges.size()};
+      codes.resize(std::max(codes.size(), blocks));
+      offsets.resize(codes.size());
+      ends.resize(codes.size());
+      if (options.stats) {
+        block_stats.resize(std::max(block_stats.size(), blocks));
+      }
+      pool.for_each(blocks, [&](size_t i) {
+        codes[i] = build_block_code(ranges[i].first, ranges[i].second, options,
+                                    block_stats_of(i), range_counts[i]);
+      });
+      size_t total{0};
+      for (size_t i = 0; i < blocks; i++) {
+        offsets[i] = total;
+        total += encoded_size(codes[i], flags);
+      }
+      char* out = dst.grow(total);
+      pool.for_each(blocks, [&](size_t i) {
+        ends[i] = write_block(ranges[i].first, ranges[i].second, codes[i],
+                              flags, out + offsets[i], block_stats_of(i));
+      });
+      // blocks of sampled codes may end before their space, the next ones
+      // are moved back to them
+      char* end = out;
+      for (size_t i = 0; i < blocks; i++) {
+        char* block = out + offsets[i];
+        if (end != block) {
+          std::copy(block, ends[i], end);
+        }
+        end += ends[i] - block;
+        index.push_back({static_cast<size_t>(ends[i] - block),
+                         static_cast<size_t>(ranges[i].second - ranges[i].first)});
+      }
+      dst.shrink(out + total - end);
+      for (size_t i = 0; i < block_stats.size(); i++) {
+        *options.stats += std::exchange(block_stats[i], {});
+      }
+    }
+  }
+  *dst.grow(1) = static_cast<char>(block_type::end);
+  if (flags & FLAG_INDEX) {
+    write_index(dst.grow(index_size(index.size())), index);
+  }
+  if (options.stats) {
+    options.stats->bytes_in += size;
+    options.stats->bytes_out += dst.size();
+  }
+}
+
+void decode_buffer_blocks(char const* first, char const* last,
+                          output_buffer& dst, decode_options const& options) {
+  if (last - first < 2) {
+    throw std::invalid_argument("corrupted input header");
+  }
+  stream_format format{check_stream_header(first)};
+  first += 2;
+
+  std::vector<located_block> own_blocks;
+  std::vector<index_entry> own_index;
+  std::vector<located_block>& blocks =
+      options.context ? options.context->scratch().blocks : own_blocks;
+  std::vector<index_entry>& index =
+      options.context ? options.context->scratch().index : own_index;
+  blocks.clear();
+  index.clear();
+  size_t total{0};
+  size_t header_size{block_header_size(format.flags)};
+  for (;;) {
+    if (first == last) {
+      throw std::invalid_argument("unexpected end of input");
+    }
+    if (static_cast<uint8_t>(*first) == static_cast<uint8_t>(block_type::end)) {
+      break;
+    }
+    if (static_cast<size_t>(last - first) < header_size) {
+      throw std::invalid_argument("unexpected end of input");
+    }
+    block_header header{read_block_header(first, format.flags)};
+    first += header_size;
+    if (static_cast<size_t>(last - first) < header.payload_size) {
+      throw std::invalid_argument("unexpected end of input");
+    }
+    blocks.push_back({first, header, total});
+    index.push_back({header_size + header.payload_size, header.size});
+    first += header.payload_size;
+    total += header.size;
+  }
+  if (format.flags & FLAG_INDEX) {
+    check_index(first + 1, last, index);
+  }
+
+  char* out = dst.grow(total);
+  if (options.threads == 1) {
+    for (located_block const& b : blocks) {
+      decode_block(b.payload, b.header, format, out + b.offset,
+                   options.table_bits, tables_of(options.context),
+                   options.stats);
+    }
+    return;
+  }
+  detail::thread_pool pool(options.threads);
+  std::vector<stats> block_stats(options.stats ? blocks.size() : 0);
+  pool.for_each(blocks.size(), [&](size_t i) {
+    located_block const& b = blocks[i];
+    decode_block(b.payload, b.header, format, out + b.offset,
+                 options.table_bits, thread_tables(),
+                 options.stats ? &block_stats[i] : nullptr);
+  });
+  for (stats const& b : block_stats) {
+    *options.stats += b;
+  }
+}
+
+// single table messages are split into chunks of at least that many
+// bytes to decode in parallel
+constexpr size_t MIN_SPECULATIVE_CHUNK = size_t{1} << 20;
+// code starts recorded at the beginning of a speculative chunk, decoding
+// from the true code start has to meet one of them; canonical codes
+// usually synchronize within some tens of bits
+constexpr size_t SYNC_BITS = 1024;
+
+// message part decoded from a bit position either known to start a code or
+// guessed to, at the start of a chunk
+struct message_chunk {
+  std::vector<char> out;
+  // code starts near the beginning, with the number of chars before them
+  std::vector<std::pair<uint64_t, size_t>> sync;
+  // first code start at or after the end of the chunk
+  uint64_t end{0};
+  stats chunk_stats;
+};
+
+uint64_t bit_position(bit_reader<char const*> const& reader,
+                      char const* message) {
+  return 8 * static_cast<uint64_t>(reader.first - message) -
+         reader.buff.length;
+}
+
+bit_reader<char const*> reader_at(char const* message, char const* last,
+                                  uint64_t position) {
+  bit_reader<char const*> reader(message + position / 8, last);
+  reader.consume(static_cast<uint8_t>(position % 8));
+  return reader;
+}
+
+// decodes chars whose codes start in [start, end) of message_bits, with
+// sync filled if record; the last chunk has to end with the message
+message_chunk decode_chunk(decoding_table const& table, char const* message,
+                           char const* last, uint64_t message_bits,
+                           uint64_t start, uint64_t end, bool record) {
+  message_chunk c;
+  phase_timer timer(&c.chunk_stats, &stats::decoding);
+  c.out.reserve(2 * (end - start) / 8);
+  bit_reader<char const*> reader{reader_at(message, last, start)};
+  auto decode_char = [&](uint64_t position) {
+    size_t avail{static_cast<size_t>(
+        std::min<uint64_t>(reader.buff.length, message_bits - position))};
+    c.out.push_back(ind_to_char(table.decode_char(reader, avail)));
+  };
+  uint64_t position{start};
+  for (; record && position < std::min(start + SYNC_BITS, end);
+       position = bit_position(reader, message)) {
+    c.sync.emplace_back(position, c.out.size());
+    decode_char(position);
+  }
+  // pairs of chars with a lookup, till close to the end of the chunk
+  std::array<bit_reader<char const*>, 1> readers{bit_reader<char const*>(
+      reader.first, std::max(reader.first, message + end / 8), reader.buff)};
+  for (size_t used = c.out.size();; used = c.out.size()) {
+    c.out.resize(used + (size_t{1} << 16));
+    std::array<char*, 1> outs{c.out.data() + used};
+    table.decode_interleaved(readers, outs, {c.out.data() + c.out.size()});
+    bool done{c.out.data() + c.out.size() - outs[0] >= 2};
+    c.out.resize(outs[0] - c.out.data());
+    if (done) {
+      break;
+    }
+  }
+  uint64_t long_codes{reader.long_codes + readers[0].long_codes};
+  reader = bit_reader<char const*>(readers[0].first, last, readers[0].buff);
+  for (position = bit_position(reader, message); position < end;
+       position = bit_position(reader, message)) {
+    decode_char(position);
+  }
+  c.end = position;
+  c.chunk_stats.coded_chars = c.out.size();
+  c.chunk_stats.slow_path_chars = long_codes + reader.long_codes;
+  return c;
+}
+
+// every thread decodes a chunk of the message from its first bit as if a
+// code started there; then, in order, the true end of the previous chunk
+// is decoded on till it meets one of the code starts of the chunk, whose
+// chars from there on are right. Chunks that don't meet it are decoded
+// again. Returns false without decoding if there would be a single chunk.
+bool decode_message_parallel(decoding_table const& table, char const* message,
+                             char const* last, uint8_t ignore_bits,
+                             output_buffer& dst,
+                             decode_options const& options) {
+  size_t size{static_cast<size_t>(last - message)};
+  detail::thread_pool pool(options.threads);
+  size_t n{std::min(pool.size(), size / MIN_SPECULATIVE_CHUNK)};
+  if (n < 2) {
+    return false;
+  }
+  uint64_t message_bits{8 * static_cast<uint64_t>(size) - ignore_bits};
+  auto chunk_start = [&](size_t i) {
+    return i == n ? message_bits : 8 * static_cast<uint64_t>(size * i / n);
+  };
+  std::vector<message_chunk> chunks(n);
+  // bytes rather than packed bits, since threads set their own at once
+  std::vector<uint8_t> synced(n, true);
+  pool.for_each(n, [&](size_t i) {
+    if (i == 0) {
+      chunks[i] = decode_chunk(table, message, last, message_bits, 0,
+                               chunk_start(1), false);
+      return;
+    }
+    // a guessed start may run into bits that aren't a code
+    try {
+      chunks[i] = decode_chunk(table, message, last, message_bits,
+                               chunk_start(i), chunk_start(i + 1), true);
+    } catch (std::invalid_argument const&) {
+      synced[i] = false;
+    }
+  });
+
+  phase_timer timer(options.stats, &stats::decoding);
+  // chars of chunk i are the chars decoded to meet it, and its own from skip
+  std::vector<std::vector<char>> heads(n);
+  std::vector<size_t> skips(n, 0);
+  for (size_t i = 1; i < n; i++) {
+    message_chunk& c = chunks[i];
+    uint64_t position{chunks[i - 1].end};
+    if (synced[i]) {
+      synced[i] = false;
+      bit_reader<char const*> reader{reader_at(message, last, position)};
+      for (auto it = c.sync.begin(); it != c.sync.end();) {
+        if (it->first < position) {
+          ++it;
+        } else if (it->first == position) {
+          synced[i] = true;
+          skips[i] = it->second;
+          break;
+        } else {
+          size_t avail{static_cast<size_t>(std::min<uint64_t>(
+              reader.buff.length, message_bits - position))};
+          heads[i].push_back(ind_to_char(table.decode_char(reader, avail)));
+          position = bit_position(reader, message);
+        }
+      }
+      if (options.stats) {
+        // speculative chars that turn out wrong are counted too
+        *options.stats += c.chunk_stats;
+        options.stats->coded_chars += heads[i].size() - skips[i];
+      }
+    }
+    if (!synced[i]) {
+      heads[i].clear();
+      skips[i] = 0;
+      c = decode_chunk(table, message, last, message_bits,
+                       chunks[i - 1].end, chunk_start(i + 1), false);
+      if (options.stats) {
+        *options.stats += c.chunk_stats;
+      }
+    }
+  }
+  if (options.stats) {
+    *options.stats += chunks[0].chunk_stats;
+    options.stats->code_bits += message_bits;
+  }
+
+  size_t total{0};
+  for (size_t i = 0; i < n; i++) {
+    total += heads[i].size() + chunks[i].out.size() - skips[i];
+  }
+  char* out = dst.grow(total);
+  for (size_t i = 0; i < n; i++) {
+    out = std::copy(heads[i].begin(), heads[i].end(), out);
+    out = std::copy(chunks[i].out.begin() + skips[i], chunks[i].out.end(), out);
+  }
+  return true;
+}
+
+void decode_buffer_single(char const* first, char const* last,
+                          output_buffer& dst, decode_options const& options) {
+  if (static_cast<size_t>(last - first) < 256 + 1) {
+    throw std::invalid_argument("corrupted input header");
+  }
+  uint8_t ignore_bits{static_cast<uint8_t>(first[256])};
+  if (ignore_bits > 8) {
+    throw std::invalid_argument("bad ignore_bits value");
+  }
+  // code lengths are stored as in format version 1 blocks
+  std::shared_ptr<decoding_table const> table_ptr{
+      get_table(first, last, 1, options.table_bits,
+                tables_of(options.context), options.stats)};
+  decoding_table const& table = *table_ptr;
+  first++;
+  if (options.threads != 1 &&
+      decode_message_parallel(table, first, last, ignore_bits, dst, options)) {
+    return;
+  }
+  phase_timer timer(options.stats, &stats::decoding);
+  bit_reader<char const*> reader(first, last);
+  size_t start{dst.size()};
+  auto add_stats = [&] {
+    if (options.stats) {
+      options.stats->coded_chars += dst.size() - start;
+      options.stats->code_bits +=
+          8 * static_cast<uint64_t>(last - first) - ignore_bits;
+      options.stats->slow_path_chars += reader.long_codes;
+    }
+  };
+  // output size is unknown, so it grows twice on every step
+  for (size_t chunk = size_t{1} << 16;; chunk *= 2) {
+    size_t n{std::min(chunk, dst.available())};
+    char* out = dst.grow(n);
+    char* end = table.decode(reader, out, out + n, ignore_bits);
+    if (end != out + n) {
+      dst.shrink(out + n - end);
+      add_stats();
+      return;
+    }
+    if (dst.available() == 0) {
+      // no place left, check that the message is over
+      char c;
+      if (table.decode(reader, &c, &c + 1, ignore_bits) != &c) {
+        throw std::invalid_argument("output buffer too small");
+      }
+      add_stats();
+      return;
+    }
+  }
+}
+
+void decode_buffer(char const* src, size_t size, output_buffer& dst,
+                   decode_options const& options) {
+  check_options(options);
+  if (size >= MAGIC.size() && has_magic(src)) {
+    decode_buffer_blocks(src + MAGIC.size(), src + size, dst, options);
+  } else {
+    decode_buffer_single(src, src + size, dst, options);
+  }
+  if (options.stats) {
+    options.stats->bytes_in += size;
+    options.stats->bytes_out += dst.size();
+  }
+}
+
+// output of a block coded by a pipeline task and stats of its coding
+struct coded_block {
+  std::vector<char> data;
+  stats block_stats;
+};
+
+void decode_blocks(std::istream& src, std::ostream& dst,
+                   decode_options const& options) {
+  std::array<char, 2> header;
+  src.read(header.data(), header.size());
+  if (src.eof()) {
+    throw std::invalid_argument("corrupted input header");
+  }
+  stream_format format{check_stream_header(header.data())};
+
+  stats* s{options.stats};
+  detail::thread_pool pool(options.threads);
+  detail::ordered_pipeline<coded_block> pipeline(
+      pool, [&dst, s](coded_block& block) {
+        phase_timer timer(s, &stats::io);
+        dst.write(block.data.data(), block.data.size());
+        if (s) {
+          *s += block.block_stats;
+          s->bytes_out += block.data.size();
+        }
+      });
+  std::vector<index_entry> index;
+  size_t header_size{block_header_size(format.flags)};
+  uint64_t bytes_in{STREAM_HEADER_SIZE + 1};
+  for (;;) {
+    std::array<char, BLOCK_HEADER_SIZE + CHECKSUM_SIZE> block_header_data;
+    std::vector<char> payload;
+    block_header header;
+    {
+      phase_timer timer(s, &stats::io);
+      if (!src.get(block_header_data[0])) {
+        throw std::invalid_argument("unexpected end of input");
+      }
+      if (static_cast<uint8_t>(block_header_data[0]) ==
+          static_cast<uint8_t>(block_type::end)) {
+        break;
+      }
+      src.read(block_header_data.data() + 1, header_size - 1);
+      if (src.eof()) {
+        throw std::invalid_argument("corrupted block header");
+      }
+      header = read_block_header(block_header_data.data(), format.flags);
+      payload.resize(header.payload_size);
+      src.read(payload.data(), payload.size());
+      if (static_cast<size_t>(src.gcount()) != payload.size()) {
+        throw std::invalid_argument("unexpected end of input");
+      }
+    }
+    index.push_back({header_size + header.payload_size, header.size});
+    bytes_in += index.back().encoded_size;
+    pipeline.push(
+        [payload = std::move(payload), header, format, &options, s]() {
+          coded_block block{std::vector<char>(header.size), {}};
+          decode_block(payload.data(), header, format, block.data.data(),
+                       options.table_bits, thread_tables(),
+                       s ? &block.block_stats : nullptr);
+          return block;
+        });
+  }
+  pipeline.finish();
+  if (format.flags & FLAG_INDEX) {
+    std::vector<char> index_data(index_size(index.size()));
+    {
+      phase_timer timer(s, &stats::io);
+      src.read(index_data.data(), index_data.size());
+    }
+    if (static_cast<size_t>(src.gcount()) != index_data.size()) {
+      throw std::invalid_argument("corrupted index");
+    }
+    check_index(index_data.data(), index_data.data() + index_data.size(),
+                index);
+    bytes_in += index_data.size();
+  }
+  if (s) {
+    s->bytes_in += bytes_in;
+  }
+}
+
+// random access to block mode input of src_size bytes, read(position, n)
+// returns n input bytes starting at position. Blocks are found with the index
+// when there is one, otherwise by walking their headers, and only those
+// holding [offset, offset + length) are read and decoded; write gets the
+// range piece by piece.
+template <typename Read, typename Write>
+void decode_range_blocks(Read const& read, uint64_t src_size, uint64_t offset,
+                         size_t length, Write const& write,
+                         decode_options const& options) {
+  check_options(options);
+  if (src_size < STREAM_HEADER_SIZE) {
+    throw std::invalid_argument("random access needs block mode input");
+  }
+  std::vector<char> header{read(0, STREAM_HEADER_SIZE)};
+  if (!has_magic(header.data())) {
+    throw std::invalid_argument("random access needs block mode input");
+  }
+  stream_format format{check_stream_header(header.data() + MAGIC.size())};
+  size_t header_size{block_header_size(format.flags)};
+
+  struct block {
+    uint64_t position;
+    uint64_t offset;
+    index_entry entry;
+  };
+  std::vector<block> blocks;
+  uint64_t position{STREAM_HEADER_SIZE};
+  uint64_t total{0};
+  if (format.flags & FLAG_INDEX) {
+    if (src_size < STREAM_HEADER_SIZE + 1 + INDEX_FOOTER_SIZE) {
+      throw std::invalid_argument("corrupted index");
+    }
+    size_t count{read_index_footer(
+        read(src_size - INDEX_FOOTER_SIZE, INDEX_FOOTER_SIZE).data())};
+    if ((src_size - STREAM_HEADER_SIZE - 1 - INDEX_FOOTER_SIZE) /
+            INDEX_ENTRY_SIZE < count) {
+      throw std::invalid_argument("corrupted index");
+    }
+    std::vector<char> entries{
+        read(src_size - index_size(count), count * INDEX_ENTRY_SIZE)};
+    for (size_t i = 0; i < count; i++) {
+      index_entry e{read_le32(entries.data() + INDEX_ENTRY_SIZE * i),
+                    read_le32(entries.data() + INDEX_ENTRY_SIZE * i + 4)};
+      if (e.encoded_size < header_size || e.size > MAX_BLOCK_SIZE) {
+        throw std::invalid_argument("corrupted index");
+      }
+      blocks.push_back({position, total, e});
+      position += e.encoded_size;
+      total += e.size;
+    }
+    if (position + 1 + index_size(count) != src_size) {
+      throw std::invalid_argument("corrupted index");
+    }
+  } else {
+    for (;;) {
+      if (position >= src_size) {
+        throw std::invalid_argument("unexpected end of input");
+      }
+      if (static_cast<uint8_t>(read(position, 1)[0]) ==
+          static_cast<uint8_t>(block_type::end)) {
+        break;
+      }
+      if (src_size - position < header_size) {
+        throw std::invalid_argument("unexpected end of input");
+      }
+      block_header header{
+          read_block_header(read(position, header_size).data(), format.flags)};
+      index_entry e{header_size + header.payload_size, header.size};
+      blocks.push_back({position, total, e});
+      position += e.encoded_size;
+      total += e.size;
+    }
+  }
+  if (offset > total || length > total - offset) {
+    throw std::invalid_argument("range out of bounds");
+  }
+
+  detail::thread_pool pool(options.threads);
+  detail::ordered_pipeline<std::vector<char>> pipeline(
+      pool, [&write](std::vector<char>& piece) {
+        write(piece.data(), piece.size());
+      });
+  // first block ending after offset
+  auto it = std::upper_bound(blocks.begin(), blocks.end(), offset,
+                             [](uint64_t offset, block const& b) {
+                               return offset < b.offset + b.entry.size;
+                             });
+  for (; it != blocks.end() && it->offset < offset + length; ++it) {
+    if (src_size - it->position < it->entry.encoded_size) {
+      throw std::invalid_argument("unexpected end of input");
+    }
+    std::vector<char> data{read(it->position, it->entry.encoded_size)};
+    block_header header{read_block_header(data.data(), format.flags)};
+    if (!(index_entry{header_size + header.payload_size, header.size} ==
+          it->entry)) {
+      throw std::invalid_argument("corrupted index");
+    }
+    size_t first{static_cast<size_t>(std::max(offset, it->offset) - it->offset)};
+    size_t last{static_cast<size_t>(
+        std::min(offset + length, it->offset + header.size) - it->offset)};
+    pipeline.push([data = std::move(data), header, header_size, format, first,
+                   last, &options]() {
+      std::vector<char> block(header.size);
+      decode_block(data.data() + header_size, header, format, block.data(),
+                   options.table_bits, thread_tables(), nullptr);
+      block.erase(block.begin() + last, block.end());
+      block.erase(block.begin(), block.begin() + first);
+      return block;
+    });
+  }
+  pipeline.finish();
+}
+
+// header is the part of the code lengths that has been read already
+void decode_single(std::istream& src, std::ostream& dst,
+                   decode_options const& options, unsigned char const* header,
+                   size_t header_length) {
+  stats* s{options.stats};
+  // code lengths and ignore_bits
+  std::array<char, 256 + 1> header_data;
+  std::copy(header, header + header_length, header_data.begin());
+  src.read(header_data.data() + header_length,
+           header_data.size() - header_length);
+  if (static_cast<size_t>(src.gcount()) !=
+      header_data.size() - header_length) {
+    throw std::invalid_argument("corrupted input header");
+  }
+  uint8_t ignore_bits{static_cast<uint8_t>(header_data.back())};
+  if (ignore_bits > 8) {
+    throw std::invalid_argument("bad ignore_bits value");
+  }
+  char const* lengths = header_data.data();
+  std::shared_ptr<decoding_table const> table_ptr{
+      get_table(lengths, header_data.data() + 256, 1, options.table_bits,
+                thread_tables(), s)};
+  decoding_table const& table = *table_ptr;
+  // message is read in chunks and decoded into a buffer written at once;
+  // bits left at the end of a chunk are carried to the next one, and only
+  // the last chunk is decoded with padding and corruption checks
+  std::vector<char> in(size_t{1} << 16);
+  std::vector<char> out(size_t{1} << 16);
+  auto flush = [&](char const* end) {
+    phase_timer timer(s, &stats::io);
+    dst.write(out.data(), end - out.data());
+    if (s) {
+      s->bytes_out += end - out.data();
+      s->coded_chars += end - out.data();
+    }
+  };
+  code carry{0, 0};
+  uint64_t message_size{0};
+  for (;;) {
+    size_t n;
+    {
+      phase_timer timer(s, &stats::io);
+      src.read(in.data(), in.size());
+      n = static_cast<size_t>(src.gcount());
+    }
+    message_size += n;
+    bool last_chunk{n < in.size()};
+    std::array<bit_reader<char const*>, 1> readers{
+        bit_reader<char const*>(in.data(), in.data() + n, carry)};
+    if (last_chunk) {
+      for (;;) {
+        char* end;
+        {
+          phase_timer timer(s, &stats::decoding);
+          end = table.decode(readers[0], out.data(), out.data() + out.size(),
+                             ignore_bits);
+        }
+        flush(end);
+        if (end != out.data() + out.size()) {
+          break;
+        }
+      }
+    } else {
+      // stops short of the output end or, with all the chunk in the reader,
+      // when too few bits are left to decode without checks
+      for (;;) {
+        std::array<char*, 1> outs{out.data()};
+        {
+          phase_timer timer(s, &stats::decoding);
+          table.decode_interleaved(readers, outs, {out.data() + out.size()});
+        }
+        flush(outs[0]);
+        if (out.data() + out.size() - outs[0] >= 2) {
+          break;
+        }
+      }
+      assert(readers[0].exhausted());
+      carry = readers[0].buff;
+    }
+    if (s) {
+      s->slow_path_chars += readers[0].long_codes;
+    }
+    if (last_chunk) {
+      break;
+    }
+  }
+  if (s) {
+    s->bytes_in += header_data.size() + message_size;
+    s->code_bits += 8 * message_size - ignore_bits;
+  }
+}
+
+// records of a batch go to parts taken by pool threads, a few per thread
+// since records differ in size
+size_t batch_parts(size_t count, detail::thread_pool const& pool) {
+  return pool.size() == 1 ? 1 : std::min(count, 4 * pool.size());
+}
+
+// code(i, p, arena) appends the output of input i of part p to arena; every
+// part is coded by one thread into its own arena, which are then joined into
+// dst
+template <typename F>
+void encode_batch_parts(size_t count, huffman::batch_output& dst,
+                        detail::thread_pool& pool, F const& code) {
+  dst.data.clear();
+  dst.offsets.clear();
+  dst.offsets.reserve(count + 1);
+  dst.offsets.push_back(0);
+  if (pool.size() == 1) {
+    for (size_t i = 0; i < count; i++) {
+      code(i, 0, dst.data);
+      dst.offsets.push_back(dst.data.size());
+    }
+    return;
+  }
+  size_t parts{batch_parts(count, pool)};
+  std::vector<std::vector<uint8_t>> arenas(parts);
+  std::vector<std::vector<size_t>> ends(parts);
+  pool.for_each(parts, [&](size_t p) {
+    for (size_t i = count * p / parts; i < count * (p + 1) / parts; i++) {
+      code(i, p, arenas[p]);
+      ends[p].push_back(arenas[p].size());
+    }
+  });
+  std::vector<size_t> starts(parts);
+  for (size_t p = 0; p < parts; p++) {
+    starts[p] = dst.offsets.back();
+    for (size_t end : ends[p]) {
+      dst.offsets.push_back(starts[p] + end);
+    }
+  }
+  dst.data.resize(dst.offsets.back());
+  pool.for_each(parts, [&](size_t p) {
+    std::copy(arenas[p].begin(), arenas[p].end(), dst.data.begin() + starts[p]);
+  });
+}
+} // namespace
+
+struct huffman::model::tables {
+  tables(code_map const& codes, size_t table_bits)
+      : codes(codes), max_length(max_code_length(codes)),
+        decoder(this->codes, table_bits) {}
+
+  code_map codes;
+  uint8_t max_length;
+  decoding_table decoder;
+};
+
+huffman::model::model(std::shared_ptr<tables const> t) : t(std::move(t)) {}
+
+huffman::model huffman::model::train(uint8_t const* samples, size_t size,
+                                     encode_options const& options) {
+  check_options(options);
+  count_map count{};
+  count_occurrences(reinterpret_cast<char const*>(samples),
+                    reinterpret_cast<char const*>(samples) + size, count);
+  for (size_t& c : count) {
+    c++;
+  }
+  return model(std::make_shared<tables const>(
+      build_codes(count, options.code_length_limit), DEFAULT_TABLE_BITS));
+}
+
+huffman::model huffman::model::load(uint8_t const* data, size_t size,
+                                    decode_options const& options) {
+  check_options(options);
+  code_map codes{};
+  if (size != codes.size()) {
+    throw std::invalid_argument("corrupted model");
+  }
+  for (code& c : codes) {
+    c.length = *data++;
+    // any byte of a message must have a code
+    if (c.length == 0) {
+      throw std::invalid_argument("corrupted model");
+    }
+  }
+  return model(std::make_shared<tables const>(codes, options.table_bits));
+}
+
+void huffman::model::save(std::vector<uint8_t>& dst) const {
+  for (code const& c : t->codes) {
+    dst.push_back(c.length);
+  }
+}
+
+void huffman::model::encode(uint8_t const* src, size_t size,
+                            std::vector<uint8_t>& dst) const {
+  output_buffer out(dst);
+  size_t capacity{MAX_VARINT_SIZE + (size * t->max_length + 7) / 8};
+  char* first = out.grow(capacity);
+  bit_writer writer(write_varint(first, size));
+  put_chars(writer, reinterpret_cast<char const*>(src),
+            reinterpret_cast<char const*>(src) + size, t->codes, t->max_length,
+            first + capacity);
+  out.shrink(first + capacity - writer.finish());
+}
+
+void huffman::model::encode_batch(buffer const* inputs, size_t count,
+                                  batch_output& dst, size_t threads) const {
+  detail::thread_pool pool(threads);
+  encode_batch_parts(count, dst, pool,
+                     [&](size_t i, size_t, std::vector<uint8_t>& arena) {
+                       encode(inputs[i].data, inputs[i].size, arena);
+                     });
+}
+
+void huffman::model::decode(uint8_t const* src, size_t size,
+                            std::vector<uint8_t>& dst) const {
+  char const* first = reinterpret_cast<char const*>(src);
+  char const* last = first + size;
+  uint64_t length;
+  first = read_varint(first, last, length);
+  // every code takes at least a bit
+  if (length > 8 * static_cast<uint64_t>(last - first)) {
+    throw std::invalid_argument("corrupted input message");
+  }
+  output_buffer out(dst);
+  char* begin = out.grow(length);
+  bit_reader<char const*> reader(first, last);
+  finish_stream(t->decoder, reader, begin, begin + length);
+}
+
+struct huffman::encoder::state {
+  explicit state(encode_options const& options)
+      : options(options), flags(stream_flags(options)) {
+    check_options(options);
+  }
+
+  void start(output_buffer& out) {
+    if (!started) {
+      write_stream_header(out.grow(STREAM_HEADER_SIZE), flags);
+      started = true;
+    }
+  }
+
+  // a chunk of input, which may be split into several blocks
+  void write(char const* chunk, char const* chunk_last, output_buffer& out) {
+    split_blocks(chunk, chunk_last, options, split, nullptr);
+    for (size_t i = 0; i < split.ends.size(); i++) {
+      char const* first = chunk + (i == 0 ? 0 : split.ends[i - 1]);
+      char const* last = chunk + split.ends[i];
+      block_code codes{build_block_code(first, last, options, nullptr,
+                                        split.counts_of(i))};
+      size_t reserved{encoded_size(codes, flags)};
+      char* block = out.grow(reserved);
+      size_t size{static_cast<size_t>(
+          write_block(first, last, codes, flags, block, nullptr) - block)};
+      out.shrink(reserved - size);
+      index.push_back({size, static_cast<size_t>(last - first)});
+    }
+  }
+
+  encode_options options;
+  uint8_t flags;
+  bool started{false};
+  // input of the block that isn't full yet
+  std::vector<char> block;
+  std::vector<index_entry> index;
+  chunk_split split;
+};
+
+huffman::encoder::encoder(encode_options const& options)
+    : s(std::make_unique<state>(options)) {}
+
+huffman::encoder::encoder(encoder&&) noexcept = default;
+
+huffman::encoder& huffman::encoder::operator=(encoder&&) noexcept = default;
+
+huffman::encoder::~encoder() = default;
+
+void huffman::encoder::feed(uint8_t const* data, size_t size,
+                            std::vector<uint8_t>& dst) {
+  output_buffer out(dst);
+  s->start(out);
+  char const* first = reinterpret_cast<char const*>(data);
+  char const* last = first + size;
+  size_t block_size{s->options.block_size};
+  while (first != last) {
+    // whole blocks are coded right from the input
+    if (s->block.empty() && static_cast<size_t>(last - first) >= block_size) {
+      s->write(first, first + block_size, out);
+      first += block_size;
+      continue;
+    }
+    size_t n{std::min(block_size - s->block.size(),
+                      static_cast<size_t>(last - first))};
+    s->block.insert(s->block.end(), first, first + n);
+    first += n;
+    if (s->block.size() == block_size) {
+      s->write(s->block.data(), s->block.data() + block_size, out);
+      s->block.clear();
+    }
+  }
+}
+
+void huffman::encoder::finish(std::vector<uint8_t>& dst) {
+  output_buffer out(dst);
+  s->start(out);
+  if (!s->block.empty()) {
+    s->write(s->block.data(), s->block.data() + s->block.size(), out);
+    s->block.clear();
+  }
+  *out.grow(1) = static_cast<char>(block_type::end);
+  if (s->flags & FLAG_INDEX) {
+    write_index(out.grow(index_size(s->index.size())), s->index);
+  }
+  s->index.clear();
+  s->started = false;
+}
+
+// input is taken a piece at a time: headers are collected in pending, a
+// stream is decoded as far as its bits go and the rest kept in carry, or
+// in pending too when only its last char is left
+struct huffman::decoder::state {
+  enum class stage {
+    magic,
+    stream_header,
+    block_start,
+    block_header,
+    code_lengths,
+    jump_table,
+    stream,
+    payload,
+    raw,
+    run,
+    index,
+    done
+  };
+
+  explicit state(decode_options const& options) : options(options) {
+    check_options(options);
+  }
+
+  // moves input to pending till it holds n bytes, returns whether it does
+  bool collect(char const*& first, char const* last, size_t n) {
+    if (pending.size() < n) {
+      size_t take{std::min(n - pending.size(),
+                           static_cast<size_t>(last - first))};
+      pending.insert(pending.end(), first, first + take);
+      first += take;
+    }
+    return pending.size() >= n;
+  }
+
+  // copy of the block is kept to verify its checksum
+  void decoded(char const* first, char const* last) {
+    if (format.flags & FLAG_CHECKSUMS) {
+      block_data.insert(block_data.end(), first, last);
+    }
+  }
+
+  void start_stream(size_t i) {
+    stream = i;
+    stream_left = stream_sizes[i];
+    chars_left = streams == 1 ? header.size
+                              : stream_start(header.size, i + 1) -
+                                    stream_start(header.size, i);
+    carry = {0, 0};
+    current = stage::stream;
+  }
+
+  void end_block() {
+    if ((format.flags & FLAG_CHECKSUMS) &&
+        checksum(reinterpret_cast<uint8_t const*>(block_data.data()),
+                 block_data.size()) != header.checksum) {
+      throw std::invalid_argument("block checksum mismatch");
+    }
+    block_data.clear();
+    current = stage::block_start;
+  }
+
+  // returns whether the code lengths are complete
+  bool read_lengths(char const*& first, char const* last) {
+    size_t n{format.version == 1 ? size_t{256} : 2 + LENGTHS_BITMAP_SIZE};
+    if (n <= payload_left && collect(first, last, n)) {
+      n = stored_lengths_size(pending.data(), format.version);
+    }
+    if (n > payload_left) {
+      throw std::invalid_argument("corrupted block header");
+    }
+    if (!collect(first, last, n)) {
+      return false;
+    }
+    char const* lengths = pending.data();
+    table = get_table(lengths, lengths + n, format.version,
+                      options.table_bits, thread_tables(), nullptr);
+    payload_left -= n;
+    pending.clear();
+    return true;
+  }
+
+  // decodes the part of the current stream in [first, last)
+  void decode_stream(char const*& first, char const* last, output_buffer& out) {
+    char const* part_last =
+        first + std::min(stream_left, static_cast<size_t>(last - first));
+    stream_left -= part_last - first;
+    if (pending.empty()) {
+      std::array<bit_reader<char const*>, 1> readers{
+          bit_reader<char const*>(first, part_last, carry)};
+      // every char takes at least a bit
+      size_t n{std::min(chars_left,
+                        readers[0].buff.length +
+                            8 * static_cast<size_t>(part_last - readers[0].first))};
+      char* begin = out.grow(n);
+      std::array<char*, 1> outs{begin};
+      table->decode_interleaved(readers, outs, {begin + n});
+      out.shrink(begin + n - outs[0]);
+      decoded(begin, outs[0]);
+      chars_left -= outs[0] - begin;
+      carry = readers[0].buff;
+      // bytes not taken by the reader when no space is left for a step
+      pending.assign(readers[0].first, part_last);
+    } else {
+      pending.insert(pending.end(), first, part_last);
+    }
+    first = part_last;
+  }
+
+  void finish_stream(output_buffer& out) {
+    bit_reader<char const*> reader(pending.data(),
+                                   pending.data() + pending.size(), carry);
+    char* begin = out.grow(chars_left);
+    ::finish_stream(*table, reader, begin, begin + chars_left);
+    decoded(begin, begin + chars_left);
+    pending.clear();
+  }
+
+  void feed(char const* first, char const* last, output_buffer& out) {
+    for (;;) {
+      switch (current) {
+      case stage::magic:
+        if (!collect(first, last, MAGIC.size())) {
+          return;
+        }
+        if (!has_magic(pending.data())) {
+          throw std::invalid_argument(
+              "incremental decode needs block mode input");
+        }
+        current = stage::stream_header;
+        break;
+      case stage::stream_header:
+        if (!collect(first, last, STREAM_HEADER_SIZE)) {
+          return;
+        }
+        format = check_stream_header(pending.data() + MAGIC.size());
+        pending.clear();
+        current = stage::block_start;
+        break;
+      case stage::block_start:
+        if (!collect(first, last, 1)) {
+          return;
+        }
+        if (static_cast<uint8_t>(pending[0]) ==
+            static_cast<uint8_t>(block_type::end)) {
+          pending.clear();
+          current = format.flags & FLAG_INDEX ? stage::index : stage::done;
+        } else {
+          current = stage::block_header;
+        }
+        break;
+      case stage::block_header:
+        if (!collect(first, last, block_header_size(format.flags))) {
+          return;
+        }
+        header = read_block_header(pending.data(), format.flags);
+        index.push_back({pending.size() + header.payload_size, header.size});
+        payload_left = header.payload_size;
+        pending.clear();
+        if (header.type == block_type::raw) {
+          current = stage::raw;
+        } else if (header.type == block_type::run) {
+          current = stage::run;
+        } else if (header.type == block_type::context ||
+                   header.type == block_type::bwt) {
+          current = stage::payload;
+        } else {
+          current = stage::code_lengths;
+        }
+        break;
+      case stage::code_lengths:
+        if (!read_lengths(first, last)) {
+          return;
+        }
+        if (header.type == block_type::interleaved) {
+          current = stage::jump_table;
+        } else {
+          streams = 1;
+          stream_sizes[0] = payload_left;
+          start_stream(0);
+        }
+        break;
+      case stage::jump_table:
+        if (payload_left < JUMP_TABLE_SIZE) {
+          throw std::invalid_argument("corrupted block header");
+        }
+        if (!collect(first, last, JUMP_TABLE_SIZE)) {
+          return;
+        }
+        payload_left -= JUMP_TABLE_SIZE;
+        for (size_t i = 0; i + 1 < INTERLEAVED_STREAMS; i++) {
+          stream_sizes[i] = read_le32(pending.data() + 4 * i);
+          if (stream_sizes[i] > payload_left) {
+            throw std::invalid_argument("corrupted block header");
+          }
+          payload_left -= stream_sizes[i];
+        }
+        stream_sizes[INTERLEAVED_STREAMS - 1] = payload_left;
+        streams = INTERLEAVED_STREAMS;
+        pending.clear();
+        start_stream(0);
+        break;
+      case stage::stream:
+        if (stream_left > 0) {
+          if (first == last) {
+            return;
+          }
+          decode_stream(first, last, out);
+        }
+        if (stream_left == 0) {
+          finish_stream(out);
+          if (stream + 1 < streams) {
+            start_stream(stream + 1);
+          } else {
+            end_block();
+          }
+        }
+        break;
+      // chars of context blocks depend on the previous ones and those of bwt
+      // blocks on all the others, so the whole payload is collected first
+      case stage::payload: {
+        if (!collect(first, last, header.payload_size)) {
+          return;
+        }
+        char* begin = out.grow(header.size);
+        decode_payload(pending.data(), header, format.version, begin,
+                       options.table_bits, thread_tables(), nullptr);
+        decoded(begin, begin + header.size);
+        pending.clear();
+        end_block();
+        break;
+      }
+      case stage::raw:
+        if (payload_left > 0) {
+          if (first == last) {
+            return;
+          }
+          size_t n{std::min(payload_left, static_cast<size_t>(last - first))};
+          char* begin = out.grow(n);
+          std::copy(first, first + n, begin);
+          decoded(begin, begin + n);
+          first += n;
+          payload_left -= n;
+        }
+        if (payload_left == 0) {
+          end_block();
+        }
+        break;
+      case stage::run: {
+        if (!collect(first, last, 1)) {
+          return;
+        }
+        char* begin = out.grow(header.size);
+        std::fill_n(begin, header.size, pending[0]);
+        decoded(begin, begin + header.size);
+        pending.clear();
+        end_block();
+        break;
+      }
+      case stage::index:
+        if (!collect(first, last, index_size(index.size()))) {
+          return;
+        }
+        check_index(pending.data(), pending.data() + pending.size(), index);
+        pending.clear();
+        current = stage::done;
+        break;
+      case stage::done:
+        if (first != last) {
+          throw std::invalid_argument("data after end of stream");
+        }
+        return;
+      }
+    }
+  }
+
+  decode_options options;
+  stage current{stage::magic};
+  std::vector<char> pending;
+  stream_format format{};
+  block_header header{};
+  size_t payload_left{0};
+  std::shared_ptr<decoding_table const> table;
+  size_t streams{1};
+  std::array<size_t, INTERLEAVED_STREAMS> stream_sizes{};
+  size_t stream{0};
+  // input bytes and chars left in the current stream
+  size_t stream_left{0};
+  size_t chars_left{0};
+  code carry{0, 0};
+  std::vector<char> block_data;
+  std::vector<index_entry> index;
+};
+
+huffman::decoder::decoder(decode_options const& options)
+    : s(std::make_unique<state>(options)) {}
+
+huffman::decoder::decoder(decoder&&) noexcept = default;
+
+huffman::decoder& huffman::decoder::operator=(decoder&&) noexcept = default;
+
+huffman::decoder::~decoder() = default;
+
+void huffman::decoder::feed(uint8_t const* data, size_t size,
+                            std::vector<uint8_t>& dst) {
+  output_buffer out(dst);
+  char const* first = reinterpret_cast<char const*>(data);
+  s->feed(first, first + size, out);
+}
+
+void huffman::decoder::finish() {
+  if (s->current != state::stage::done) {
+    throw std::invalid_argument("unexpected end of input");
+  }
+  s->index.clear();
+  s->current = state::stage::magic;
+}
+
+double huffman::stats::average_code_length() const {
+  return coded_chars == 0 ? 0 : static_cast<double>(code_bits) / coded_chars;
+}
+
+huffman::stats& huffman::stats::operator+=(stats const& other) {
+  bytes_in += other.bytes_in;
+  bytes_out += other.bytes_out;
+  blocks += other.blocks;
+  coded_chars += other.coded_chars;
+  code_bits += other.code_bits;
+  slow_path_chars += other.slow_path_chars;
+  histogram += other.histogram;
+  code_lengths += other.code_lengths;
+  canonical_codes += other.canonical_codes;
+  bit_packing += other.bit_packing;
+  decoding_tables += other.decoding_tables;
+  reused_tables += other.reused_tables;
+  decoding += other.decoding;
+  checksums += other.checksums;
+  io += other.io;
+  transform += other.transform;
+  return *this;
+}
+
+size_t huffman::max_compressed_size(size_t size, encode_options const& options) {
+  check_options(options);
+  size_t blocks{(size + options.block_size - 1) / options.block_size};
+  if (options.adaptive) {
+    // split_blocks may end a block after every piece of a chunk
+    auto pieces = [](size_t n) {
+      return (n + SPLIT_PIECE_SIZE - 1) / SPLIT_PIECE_SIZE;
+    };
+    blocks = size / options.block_size * pieces(options.block_size) +
+             pieces(size % options.block_size);
+  }
+  // blocks that don't get shorter are stored raw
+  size_t result{STREAM_HEADER_SIZE + 1 +
+                blocks * block_header_size(stream_flags(options)) + size};
+  if (options.index) {
+    result += index_size(blocks);
+  }
+  return result;
+}
+
+void huffman::encode(uint8_t const* src, size_t size, std::vector<uint8_t>& dst,
+                     encode_options const& options) {
+  output_buffer out(dst);
+  encode_buffer(reinterpret_cast<char const*>(src), size, out, options);
+}
+
+size_t huffman::encode(uint8_t const* src, size_t size, uint8_t* dst,
+                       size_t capacity, encode_options const& options) {
+  output_buffer out(dst, capacity);
+  encode_buffer(reinterpret_cast<char const*>(src), size, out, options);
+  return out.size();
+}
+
+void huffman::encode_batch(buffer const* inputs, size_t count,
+                           batch_output& dst, encode_options const& options) {
+  check_options(options);
+  detail::thread_pool pool(options.threads);
+  // records are spread over threads, each one coded by a single thread with
+  // stats of its part; the context can't be shared by threads
+  encode_options record_options{options};
+  record_options.threads = 1;
+  if (pool.size() != 1) {
+    record_options.context = nullptr;
+  }
+  std::vector<stats> part_stats(options.stats ? batch_parts(count, pool) : 0);
+  encode_batch_parts(count, dst, pool,
+                     [&](size_t i, size_t p, std::vector<uint8_t>& arena) {
+                       encode_options o{record_options};
+                       o.stats = options.stats ? &part_stats[p] : nullptr;
+                       encode(inputs[i].data, inputs[i].size, arena, o);
+                     });
+  for (stats const& s : part_stats) {
+    *options.stats += s;
+  }
+}
+
+void huffman::decode(uint8_t const* src, size_t size, std::vector<uint8_t>& dst,
+                     decode_options const& options) {
+  output_buffer out(dst);
+  decode_buffer(reinterpret_cast<char const*>(src), size, out, options);
+}
+
+size_t huffman::decode(uint8_t const* src, size_t size, uint8_t* dst,
+                       size_t capacity, decode_options const& options) {
+  output_buffer out(dst, capacity);
+  decode_buffer(reinterpret_cast<char const*>(src), size, out, options);
+  return out.size();
+}
+
+void huffman::decode_range(uint8_t const* src, size_t size, uint64_t offset,
+                           size_t length, std::vector<uint8_t>& dst,
+                           decode_options const& options) {
+  char const* data = reinterpret_cast<char const*>(src);
+  decode_range_blocks(
+      [data](uint64_t position, size_t n) {
+        return std::vector<char>(data + position, data + position + n);
+      },
+      size, offset, length,
+      [&dst](char const* piece, size_t n) {
+        dst.insert(dst.end(), piece, piece + n);
+      },
+      options);
+}
+
+void huffman::decode_range(std::istream& src, uint64_t offset, size_t length,
+                           std::ostream& dst, decode_options const& options) {
+  src.exceptions(std::ios::badbit);
+  std::streampos start = src.tellg();
+  src.seekg(0, std::ios::end);
+  std::streampos end = src.tellg();
+  if (start == std::streampos(-1) || end == std::streampos(-1)) {
+    throw std::invalid_argument("random access needs seekable input");
+  }
+  decode_range_blocks(
+      [&src, start](uint64_t position, size_t n) {
+        std::vector<char> data(n);
+        src.clear();
+        src.seekg(start + static_cast<std::streamoff>(position));
+        src.read(data.data(), n);
+        if (static_cast<size_t>(src.gcount()) != n) {
+          throw std::invalid_argument("unexpected end of input");
+        }
+        return data;
+      },
+      static_cast<uint64_t>(end - start), offset, length,
+      [&dst](char const* piece, size_t n) { dst.write(piece, n); }, options);
+}
+
+void huffman::encode(std::istream& src, std::ostream& dst) {
+  src.exceptions(std::ios::badbit);
+  // count occurrences
+  count_map count{};
+  std::vector<char> buff(1 << 16);
+  while (src.read(buff.data(), buff.size()) || src.gcount() > 0) {
+    count_occurrences(buff.data(), buff.data() + src.gcount(), count);
+  }
+  // huffman coding
+  code_map codes = build_codes(count, DEFAULT_CODE_LENGTH_LIMIT);
+
+  for (code& c : codes) {
+    write_byte(dst, c.length);
+  }
+
+  size_t msg_length{message_length(count, codes)};
+  uint8_t ignore_bits{static_cast<uint8_t>((8 - (msg_length % 8)) % 8)};
+  write_byte(dst, ignore_bits);
+  // encode message
+  src.clear();
+  src.seekg(0, std::ios::beg);
+  // every char takes at most 4 bytes
+  std::vector<char> out(4 * buff.size() + 8);
+  bit_writer writer(out.data());
+  uint8_t max_length{max_code_length(codes)};
+  while (src.read(buff.data(), buff.size()) || src.gcount() > 0) {
+    put_chars(writer, buff.data(), buff.data() + src.gcount(), codes,
+              max_length, out.data() + out.size());
+    dst.write(out.data(), writer.position() - out.data());
+    writer.rewind(out.data());
+  }
+  char* end = writer.finish();
+  dst.write(out.data(), end - out.data());
+}
+
+void huffman::encode(std::istream& src, std::ostream& dst,
+                     encode_options const& options) {
+  check_options(options);
+  src.exceptions(std::ios::badbit);
+  uint8_t flags{stream_flags(options)};
+  std::array<char, STREAM_HEADER_SIZE> header;
+  write_stream_header(header.data(), flags);
+  dst.write(header.data(), header.size());
+
+  stats* s{options.stats};
+  detail::thread_pool pool(options.threads);
+  std::vector<index_entry> index;
+  uint64_t bytes_out{STREAM_HEADER_SIZE + 1};
+  detail::ordered_pipeline<coded_block> pipeline(
+      pool, [&dst, &index, &bytes_out, flags, s](coded_block& encoded) {
+        phase_timer timer(s, &stats::io);
+        // a chunk may be coded as several blocks, which are walked by headers
+        for (char const* block = encoded.data.data();
+             block != encoded.data.data() + encoded.data.size();
+             block += index.back().encoded_size) {
+          index.push_back({block_header_size(flags) + read_le32(block + 5),
+                           read_le32(block + 1)});
+          if (s) {
+            s->bytes_in += index.back().size;
+          }
+        }
+        dst.write(encoded.data.data(), encoded.data.size());
+        bytes_out += encoded.data.size();
+        if (s) {
+          *s += encoded.block_stats;
+        }
+      });
+  for (;;) {
+    std::vector<char> block(options.block_size);
+    {
+      phase_timer timer(s, &stats::io);
+      src.read(block.data(), block.size());
+    }
+    size_t size{static_cast<size_t>(src.gcount())};
+    if (size == 0) {
+      break;
+    }
+    block.resize(size);
+    pipeline.push([block = std::move(block), &options, s]() {
+      char const* first = block.data();
+      char const* last = block.data() + block.size();
+      coded_block encoded{{}, {}};
+      stats* block_stats{s ? &encoded.block_stats : nullptr};
+      uint8_t flags{stream_flags(options)};
+      chunk_split split;
+      split_blocks(first, last, options, split, block_stats);
+      for (size_t i = 0; i < split.ends.size(); i++) {
+        char const* block_first = first + (i == 0 ? 0 : split.ends[i - 1]);
+        char const* block_last = first + split.ends[i];
+        block_code codes{build_block_code(block_first, block_last, options,
+                                          block_stats, split.counts_of(i))};
+        size_t used{encoded.data.size()};
+        encoded.data.resize(used + encoded_size(codes, flags));
+        char* end = write_block(block_first, block_last, codes, flags,
+                                encoded.data.data() + used, block_stats);
+        encoded.data.resize(end - encoded.data.data());
+      }
+      return encoded;
+    });
+  }
+  pipeline.finish();
+  phase_timer timer(s, &stats::io);
+  write_byte(dst, static_cast<uint8_t>(block_type::end));
+  if (flags & FLAG_INDEX) {
+    std::vector<char> index_data(index_size(index.size()));
+    write_index(index_data.data(), index);
+    dst.write(index_data.data(), index_data.size());
+    bytes_out += index_data.size();
+  }
+  if (s) {
+    s->bytes_out += bytes_out;
+  }
+}
+
+void huffman::decode(std::istream& src, std::ostream& dst) {
+  decode(src, dst, decode_options{});
+}
+
+void huffman::decode(std::istream& src, std::ostream& dst,
+                     decode_options const& options) {
+  check_options(options);
+  src.exceptions(std::ios::badbit);
+  std::array<unsigned char, MAGIC.size()> prefix{};
+  size_t prefix_length{0};
+  while (prefix_length < prefix.size() &&
+         read_byte(src, prefix[prefix_length])) {
+    prefix_length++;
+  }
+  if (prefix == MAGIC) {
+    decode_blocks(src, dst, options);
+  } else {
+    decode_single(src, dst, options, prefix.data(), prefix_length);
   }
 }
@@ -1,6 +1,274 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 namespace huffman {
+  constexpr size_t MIN_BLOCK_SIZE = size_t{64} << 10;
+  constexpr size_t MAX_BLOCK_SIZE = size_t{16} << 20;
+  constexpr size_t DEFAULT_BLOCK_SIZE = size_t{1} << 20;
+  // 8 bits are needed to code all chars
+  constexpr size_t MIN_CODE_LENGTH_LIMIT = 8;
+  constexpr size_t MAX_CODE_LENGTH_LIMIT = 32;
+  constexpr size_t DEFAULT_CODE_LENGTH_LIMIT = 11;
+  constexpr size_t MIN_TABLE_BITS = 8;
+  constexpr size_t MAX_TABLE_BITS = 12;
+  constexpr size_t DEFAULT_TABLE_BITS = 11;
+
+  // counters of encode and decode, which add to them when given a stats
+  // object in options; times of phases are summed over threads
+  struct stats {
+    uint64_t bytes_in{0};
+    uint64_t bytes_out{0};
+    uint64_t blocks{0};
+    // chars of Huffman coded blocks and bits of their streams, with padding
+    uint64_t coded_chars{0};
+    uint64_t code_bits{0};
+    // decoded chars whose codes are longer than the lookup table, found by
+    // the slower search of canonical code bounds
+    uint64_t slow_path_chars{0};
+    // decoded blocks and streams whose code lengths match one of the last
+    // few seen on the same thread, which reuse its decoding table
+    uint64_t reused_tables{0};
+
+    std::chrono::nanoseconds histogram{0};
+    // code lengths with length limiting and canonical code values
+    std::chrono::nanoseconds code_lengths{0};
+    std::chrono::nanoseconds canonical_codes{0};
+    std::chrono::nanoseconds bit_packing{0};
+    // code lengths reading and lookup table building
+    std::chrono::nanoseconds decoding_tables{0};
+    std::chrono::nanoseconds decoding{0};
+    std::chrono::nanoseconds checksums{0};
+    // reads and writes of stream functions
+    std::chrono::nanoseconds io{0};
+    // Burrows-Wheeler and move-to-front transforms of bwt blocks, both ways
+    std::chrono::nanoseconds transform{0};
+
+    // bits per Huffman coded char
+    double average_code_length() const;
+    stats& operator+=(stats const& other);
+  };
+
+  namespace detail {
+    struct scratch;
+  }
+
+  // scratch memory of the buffer encode and decode calls given it in options:
+  // decoding tables of recent code lengths, lists of blocks and the index.
+  // It only grows, so once it fits the inputs, calls with a single thread
+  // don't allocate, but for encode with adaptive, order-1 or Burrows-Wheeler
+  // transformed blocks and decode of the latter.
+  // A context is used by one call at a time, so every thread keeps its own.
+  class context {
+  public:
+    context();
+    context(context&&) noexcept;
+    context& operator=(context&&) noexcept;
+    ~context();
+
+    // for the library only
+    detail::scratch& scratch() {
+      return *s;
+    }
+
+  private:
+    std::unique_ptr<detail::scratch> s;
+  };
+
+  struct encode_options {
+    // input is split into blocks of this size, each one coded with its own table
+    size_t block_size{DEFAULT_BLOCK_SIZE};
+    // blocks are coded in parallel, 0 means one thread per core
+    size_t threads{1};
+    // codes are never longer, with limit up to decode_options::table_bits
+    // decoding never leaves the lookup table
+    size_t code_length_limit{DEFAULT_CODE_LENGTH_LIMIT};
+    // codes of Huffman blocks are built from counts of 4 KiB pieces making
+    // up about this fraction of the block, in (0, 1], spread evenly over it:
+    // counting is faster, but the output a bit longer. Chars missing from
+    // the pieces still get codes, and a block never ends up longer than raw.
+    double sample_fraction{1};
+    // every piece starts at a random place of its stride instead of its start,
+    // which doesn't miss data periodic in the stride
+    bool random_sampling{false};
+    // blocks end where statistics of the data change, at multiples of 16 KiB,
+    // when a new table saves more than it costs; block_size is the longest
+    // block then, which a few MiB make long enough for stable data
+    bool adaptive{false};
+    // every block is split into 4 streams decoded in the same loop, which is
+    // faster to decode at the cost of 12 bytes per block
+    bool interleaved{false};
+    // blocks are also tried with tables chosen by the previous char, which
+    // shrinks structured data at the cost of slower coding
+    bool order1{false};
+    // blocks are also tried Burrows-Wheeler transformed, with runs of equal
+    // chars made into short move-to-front codes, which shrinks repetitive
+    // data several times at the cost of much slower coding
+    bool bwt{false};
+    // every block header gets a checksum of the block, verified on decode
+    bool checksums{false};
+    // trailing index of block sizes lets decode_range find blocks without
+    // reading all the headers
+    bool index{false};
+    // collects stats when set, the encoder and decoder classes ignore it
+    huffman::stats* stats{nullptr};
+    // scratch memory reused when set, ignored by all but the buffer API
+    huffman::context* context{nullptr};
+  };
+
+  struct decode_options {
+    // block mode input is decoded in parallel, 0 means one thread per core;
+    // single table buffers of a few MiB are split into chunks whose threads
+    // guess where the first code starts and resynchronize at the boundaries
+    size_t threads{1};
+    // codes up to this length are decoded with a single lookup, several at once
+    // if they fit together
+    size_t table_bits{DEFAULT_TABLE_BITS};
+    // collects stats when set, decode_range and the decoder class ignore it
+    huffman::stats* stats{nullptr};
+    // scratch memory reused when set, ignored by all but the buffer API
+    huffman::context* context{nullptr};
+  };
+
+  // adds occurrences of every byte value in data to counts
+  void histogram(uint8_t const* data, size_t size, std::array<uint64_t, 256>& counts);
+
+  // xxHash32 of data with seed 0, used for block checksums
+  uint32_t checksum(uint8_t const* data, size_t size);
+
+  // bound of block mode output size for size bytes of input
+  size_t max_compressed_size(size_t size, encode_options const& options = {});
+
+  // block mode encode of a buffer, output is appended to dst
+  void encode(uint8_t const* src, size_t size, std::vector<uint8_t>& dst,
+              encode_options const& options = {});
+  // returns output size, throws std::invalid_argument if it exceeds capacity,
+  // which never happens with max_compressed_size(size) bytes
+  size_t encode(uint8_t const* src, size_t size, uint8_t* dst, size_t capacity,
+                encode_options const& options = {});
+  // accepts both single table and block mode input, output is appended to dst
+  void decode(uint8_t const* src, size_t size, std::vector<uint8_t>& dst,
+              decode_options const& options = {});
+  // returns output size, throws std::invalid_argument if it exceeds capacity
+  size_t decode(uint8_t const* src, size_t size, uint8_t* dst, size_t capacity,
+                decode_options const& options = {});
+
+  // input record of a batch
+  struct buffer {
+    uint8_t const* data;
+    size_t size;
+  };
+
+  // outputs of a batch in a single arena, output i is data from offsets[i]
+  // to offsets[i + 1]
+  struct batch_output {
+    std::vector<uint8_t> data;
+    std::vector<size_t> offsets;
+  };
+
+  // block mode encode of count independent buffers, output i is the same as
+  // encode of input i alone. Inputs are spread over options.threads, each
+  // coded by a single thread; dst is overwritten but keeps its capacity, so
+  // batches in a loop don't allocate once it's large enough.
+  void encode_batch(buffer const* inputs, size_t count, batch_output& dst,
+                    encode_options const& options = {});
+
+  // code trained on sample data and shared by many messages, which are coded
+  // without headers; copies share the same read-only tables, so a model can
+  // be used from several threads at once
+  class model {
+  public:
+    // every byte value gets a code, so messages may have bytes that never
+    // occur in samples
+    static model train(uint8_t const* samples, size_t size,
+                       encode_options const& options = {});
+    // reads code lengths written by save, throws std::invalid_argument if
+    // they don't form a prefix code
+    static model load(uint8_t const* data, size_t size,
+                      decode_options const& options = {});
+    // appends 256 code lengths to dst
+    void save(std::vector<uint8_t>& dst) const;
+
+    // appends message size and its code to dst
+    void encode(uint8_t const* src, size_t size, std::vector<uint8_t>& dst) const;
+    // encodes count messages as encode does, spread over threads, 0 means
+    // one per core; dst is overwritten as by huffman::encode_batch
+    void encode_batch(buffer const* inputs, size_t count, batch_output& dst,
+                      size_t threads = 1) const;
+    // src is a single encoded message, output is appended to dst
+    void decode(uint8_t const* src, size_t size, std::vector<uint8_t>& dst) const;
+
+  private:
+    struct tables;
+    explicit model(std::shared_ptr<tables const> t);
+
+    std::shared_ptr<tables const> t;
+  };
+
+  // block mode encoder fed with input piece by piece, every block is coded
+  // and output as soon as it's full, so at most a block of input is kept;
+  // options.threads is ignored
+  class encoder {
+  public:
+    explicit encoder(encode_options const& options = {});
+    encoder(encoder&&) noexcept;
+    encoder& operator=(encoder&&) noexcept;
+    ~encoder();
+
+    // appends completed blocks to dst
+    void feed(uint8_t const* data, size_t size, std::vector<uint8_t>& dst);
+    // appends the rest and end of stream to dst, after that a new stream can
+    // be fed
+    void finish(std::vector<uint8_t>& dst);
+
+  private:
+    struct state;
+    std::unique_ptr<state> s;
+  };
+
+  // block mode decoder fed with input piece by piece, decoded chars are
+  // output as soon as their codes arrive. It keeps partial headers, the
+  // table of the current block and a few message bits; with checksums also
+  // the current block, whose chars are output before it's verified.
+  class decoder {
+  public:
+    explicit decoder(decode_options const& options = {});
+    decoder(decoder&&) noexcept;
+    decoder& operator=(decoder&&) noexcept;
+    ~decoder();
+
+    // appends chars decoded so far to dst, throws std::invalid_argument on
+    // corrupted input
+    void feed(uint8_t const* data, size_t size, std::vector<uint8_t>& dst);
+    // throws std::invalid_argument if the stream isn't over, after that a new
+    // stream can be fed
+    void finish();
+
+  private:
+    struct state;
+    std::unique_ptr<state> s;
+  };
+
+  // decodes length bytes starting at offset of block mode input, only the
+  // blocks holding them are read; output is appended to dst. Throws
+  // std::invalid_argument if the range isn't within the decoded data.
+  void decode_range(uint8_t const* src, size_t size, uint64_t offset,
+                    size_t length, std::vector<uint8_t>& dst,
+                    decode_options const& options = {});
+  // src has to be seekable
+  void decode_range(std::istream& src, uint64_t offset, size_t length,
+                    std::ostream& dst, decode_options const& options = {});
+
+  // codes are limited by DEFAULT_CODE_LENGTH_LIMIT
   void encode(std::istream& src, std::ostream& dst);
+  // single pass block mode, src doesn't have to be seekable
+  void encode(std::istream& src, std::ostream& dst, encode_options const& options);
+  // accepts both single table and block mode input
   void decode(std::istream& src, std::ostream& dst);
+  void decode(std::istream& src, std::ostream& dst, decode_options const& options);
 }
@@ -0,0 +1,41 @@
+#include "thread_pool.h"
+
+using namespace huffman::detail;
+
+thread_pool::thread_pool(size_t threads) {
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  if (threads > 1) {
+    for (size_t i = 0; i < threads; i++) {
+      workers.emplace_back([this]() { work(); });
+    }
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  for (std::thread& t : workers) {
+    t.join();
+  }
+}
+
+void thread_pool::work() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [this]() { return stop || !tasks.empty(); });
+      if (stop) {
+        return;
+      }
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
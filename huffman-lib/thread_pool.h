@@ -0,0 +1,106 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace huffman::detail {
+// fixed size pool, with a single thread tasks run right in submit
+class thread_pool {
+public:
+  // 0 threads means one per hardware thread
+  explicit thread_pool(size_t threads);
+  thread_pool(thread_pool const&) = delete;
+  thread_pool& operator=(thread_pool const&) = delete;
+  ~thread_pool();
+
+  size_t size() const {
+    return std::max(workers.size(), size_t{1});
+  }
+
+  template <typename F>
+  std::future<std::invoke_result_t<F>> submit(F&& f) {
+    auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(
+        std::forward<F>(f));
+    std::future<std::invoke_result_t<F>> result = task->get_future();
+    if (workers.empty()) {
+      (*task)();
+      return result;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m);
+      tasks.emplace_back([task]() { (*task)(); });
+    }
+    cv.notify_one();
+    return result;
+  }
+
+  // runs f(i) for every i in [0, n), waits for all of them and rethrows the
+  // first exception
+  template <typename F>
+  void for_each(size_t n, F const& f) {
+    std::vector<std::future<void>> results;
+    results.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+      results.push_back(submit([&f, i]() { f(i); }));
+    }
+    for (std::future<void>& r : results) {
+      r.wait();
+    }
+    for (std::future<void>& r : results) {
+      r.get();
+    }
+  }
+
+private:
+  void work();
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> tasks;
+  bool stop{false};
+  std::vector<std::thread> workers;
+};
+
+// runs tasks on the pool and hands their results to consume in submission
+// order, keeping a bounded number of them in flight
+template <typename T>
+class ordered_pipeline {
+public:
+  ordered_pipeline(thread_pool& pool, std::function<void(T&)> consume)
+      : pool(pool), window(2 * pool.size()), consume(std::move(consume)) {}
+
+  template <typename F>
+  void push(F&& f) {
+    pending.push_back(pool.submit(std::forward<F>(f)));
+    while (pending.size() > window) {
+      pop();
+    }
+  }
+
+  void finish() {
+    while (!pending.empty()) {
+      pop();
+    }
+  }
+
+private:
+  void pop() {
+    T result = pending.front().get();
+    pending.pop_front();
+    consume(result);
+  }
+
+  thread_pool& pool;
+  size_t window;
+  std::function<void(T&)> consume;
+  std::deque<std::future<T>> pending;
+};
+} // namespace huffman::detail
@@ -0,0 +1,276 @@
+#include "transform.h"
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+// suffix array of s with chars in [0, upper] by induced sorting (SA-IS, by
+// Nong, Zhang and Chan): suffixes starting at LMS positions are sorted by
+// recursion on the string of their names, all the others are induced from
+// them in two linear passes
+std::vector<int32_t> suffix_array(std::vector<int32_t> const& s,
+                                  int32_t upper) {
+  int32_t n{static_cast<int32_t>(s.size())};
+  if (n == 0) {
+    return {};
+  }
+  if (n == 1) {
+    return {0};
+  }
+  if (n == 2) {
+    return s[0] < s[1] ? std::vector<int32_t>{0, 1}
+                       : std::vector<int32_t>{1, 0};
+  }
+  std::vector<int32_t> sa(n);
+  // whether the suffix is smaller than the next one
+  std::vector<bool> ls(n);
+  for (int32_t i = n - 2; i >= 0; i--) {
+    ls[i] = s[i] == s[i + 1] ? ls[i + 1] : s[i] < s[i + 1];
+  }
+  // bucket starts of S and L suffixes of every char
+  std::vector<int32_t> sum_l(upper + 1), sum_s(upper + 1);
+  for (int32_t i = 0; i < n; i++) {
+    if (!ls[i]) {
+      sum_s[s[i]]++;
+    } else {
+      sum_l[s[i] + 1]++;
+    }
+  }
+  for (int32_t i = 0; i <= upper; i++) {
+    sum_s[i] += sum_l[i];
+    if (i < upper) {
+      sum_l[i + 1] += sum_s[i];
+    }
+  }
+
+  std::vector<int32_t> buf(upper + 1);
+  auto induce = [&](std::vector<int32_t> const& lms) {
+    std::fill(sa.begin(), sa.end(), -1);
+    std::copy(sum_s.begin(), sum_s.end(), buf.begin());
+    for (int32_t d : lms) {
+      if (d != n) {
+        sa[buf[s[d]]++] = d;
+      }
+    }
+    std::copy(sum_l.begin(), sum_l.end(), buf.begin());
+    sa[buf[s[n - 1]]++] = n - 1;
+    for (int32_t i = 0; i < n; i++) {
+      int32_t v{sa[i]};
+      if (v >= 1 && !ls[v - 1]) {
+        sa[buf[s[v - 1]]++] = v - 1;
+      }
+    }
+    std::copy(sum_l.begin(), sum_l.end(), buf.begin());
+    for (int32_t i = n - 1; i >= 0; i--) {
+      int32_t v{sa[i]};
+      if (v >= 1 && ls[v - 1]) {
+        sa[--buf[s[v - 1] + 1]] = v - 1;
+      }
+    }
+  };
+
+  std::vector<int32_t> lms_map(n + 1, -1);
+  std::vector<int32_t> lms;
+  for (int32_t i = 1; i < n; i++) {
+    if (!ls[i - 1] && ls[i]) {
+      lms_map[i] = static_cast<int32_t>(lms.size());
+      lms.push_back(i);
+    }
+  }
+  int32_t m{static_cast<int32_t>(lms.size())};
+  induce(lms);
+  if (m == 0) {
+    return sa;
+  }
+
+  // equal LMS substrings get the same name
+  std::vector<int32_t> sorted_lms;
+  sorted_lms.reserve(m);
+  for (int32_t v : sa) {
+    if (lms_map[v] != -1) {
+      sorted_lms.push_back(v);
+    }
+  }
+  std::vector<int32_t> rec_s(m);
+  int32_t rec_upper{0};
+  rec_s[lms_map[sorted_lms[0]]] = 0;
+  for (int32_t i = 1; i < m; i++) {
+    int32_t l{sorted_lms[i - 1]};
+    int32_t r{sorted_lms[i]};
+    int32_t end_l{lms_map[l] + 1 < m ? lms[lms_map[l] + 1] : n};
+    int32_t end_r{lms_map[r] + 1 < m ? lms[lms_map[r] + 1] : n};
+    bool same{end_l - l == end_r - r};
+    if (same) {
+      for (; l < end_l && s[l] == s[r]; l++, r++) {
+      }
+      same = l != n && s[l] == s[r];
+    }
+    if (!same) {
+      rec_upper++;
+    }
+    rec_s[lms_map[sorted_lms[i]]] = rec_upper;
+  }
+  std::vector<int32_t> rec_sa{suffix_array(rec_s, rec_upper)};
+  for (int32_t i = 0; i < m; i++) {
+    sorted_lms[i] = lms[rec_sa[i]];
+  }
+  induce(sorted_lms);
+  return sa;
+}
+
+// indices up to that are coded by a single symbol
+constexpr size_t MAX_SHORT_INDEX = 253;
+constexpr uint8_t ESCAPE = 255;
+} // namespace
+
+// row 0 is the rotation starting with the end char, whose last char is the
+// last one of the block; the others follow the suffix array
+uint32_t huffman::detail::bwt_forward(char const* first, char const* last,
+                                      char* out) {
+  size_t n{static_cast<size_t>(last - first)};
+  if (n == 0) {
+    return 0;
+  }
+  std::vector<int32_t> s(n);
+  for (size_t i = 0; i < n; i++) {
+    s[i] = static_cast<unsigned char>(first[i]);
+  }
+  std::vector<int32_t> sa{suffix_array(s, 255)};
+  uint32_t primary{0};
+  *out++ = first[n - 1];
+  for (size_t i = 0; i < n; i++) {
+    if (sa[i] == 0) {
+      primary = static_cast<uint32_t>(i + 1);
+    } else {
+      *out++ = first[sa[i] - 1];
+    }
+  }
+  return primary;
+}
+
+// walks the rows backwards from row 0 by the last to first mapping, every
+// step gives the char before the current one
+void huffman::detail::bwt_inverse(char const* first, char const* last,
+                                  uint32_t primary, char* out) {
+  size_t n{static_cast<size_t>(last - first)};
+  if (n == 0) {
+    if (primary != 0) {
+      throw std::invalid_argument("corrupted input message");
+    }
+    return;
+  }
+  if (primary == 0 || primary > n) {
+    throw std::invalid_argument("corrupted input message");
+  }
+  auto last_char = [first, primary](size_t row) {
+    return static_cast<unsigned char>(first[row < primary ? row : row - 1]);
+  };
+  // the end char takes row 0 of the first column
+  std::array<uint32_t, 256> start{};
+  for (char const* p = first; p != last; ++p) {
+    start[static_cast<unsigned char>(*p)]++;
+  }
+  uint32_t sum{1};
+  for (uint32_t& c : start) {
+    sum += std::exchange(c, sum);
+  }
+  // last char of every row is packed with the row it maps to, less 1 since
+  // none maps to row 0, so that a step takes a single random access
+  std::vector<uint32_t> next(n + 1);
+  for (size_t row = 0; row <= n; row++) {
+    if (row != primary) {
+      uint32_t ch{last_char(row)};
+      next[row] = (start[ch]++ - 1) << 8 | ch;
+    }
+  }
+  size_t row{0};
+  for (size_t i = n; i > 0; i--) {
+    if (row == primary) {
+      throw std::invalid_argument("corrupted input message");
+    }
+    uint32_t e{next[row]};
+    out[i - 1] = static_cast<char>(e & 0xFF);
+    row = (e >> 8) + 1;
+  }
+  if (row != primary) {
+    throw std::invalid_argument("corrupted input message");
+  }
+}
+
+void huffman::detail::mtf_encode(char const* first, char const* last,
+                                 std::vector<char>& dst) {
+  std::array<uint8_t, 256> order;
+  std::iota(order.begin(), order.end(), 0);
+  size_t run{0};
+  auto flush_run = [&dst, &run] {
+    for (; run > 0; run = (run - 1) >> 1) {
+      dst.push_back(static_cast<char>((run - 1) & 1));
+    }
+  };
+  for (; first != last; ++first) {
+    uint8_t ch{static_cast<uint8_t>(*first)};
+    if (order[0] == ch) {
+      run++;
+      continue;
+    }
+    flush_run();
+    size_t i{1};
+    while (order[i] != ch) {
+      i++;
+    }
+    std::copy_backward(order.begin(), order.begin() + i,
+                       order.begin() + i + 1);
+    order[0] = ch;
+    if (i <= MAX_SHORT_INDEX) {
+      dst.push_back(static_cast<char>(i + 1));
+    } else {
+      dst.push_back(static_cast<char>(ESCAPE));
+      dst.push_back(static_cast<char>(i - MAX_SHORT_INDEX - 1));
+    }
+  }
+  flush_run();
+}
+
+void huffman::detail::mtf_decode(char const* first, char const* last,
+                                 char* out, char* out_end) {
+  std::array<uint8_t, 256> order;
+  std::iota(order.begin(), order.end(), 0);
+  size_t run{0};
+  size_t digit{1};
+  for (; first != last; ++first) {
+    uint8_t sym{static_cast<uint8_t>(*first)};
+    if (sym <= 1) {
+      // run can't be longer than the output left, so digit doesn't overflow
+      if ((sym + size_t{1}) * digit > static_cast<size_t>(out_end - out) - run) {
+        throw std::invalid_argument("corrupted input message");
+      }
+      run += (sym + size_t{1}) * digit;
+      digit <<= 1;
+      continue;
+    }
+    out = std::fill_n(out, run, static_cast<char>(order[0]));
+    run = 0;
+    digit = 1;
+    size_t i{sym - size_t{1}};
+    if (sym == ESCAPE) {
+      if (++first == last || static_cast<uint8_t>(*first) > 1) {
+        throw std::invalid_argument("corrupted input message");
+      }
+      i = MAX_SHORT_INDEX + 1 + static_cast<uint8_t>(*first);
+    }
+    if (out == out_end) {
+      throw std::invalid_argument("corrupted input message");
+    }
+    uint8_t ch{order[i]};
+    std::copy_backward(order.begin(), order.begin() + i,
+                       order.begin() + i + 1);
+    order[0] = ch;
+    *out++ = static_cast<char>(ch);
+  }
+  out = std::fill_n(out, run, static_cast<char>(order[0]));
+  if (out != out_end) {
+    throw std::invalid_argument("corrupted input message");
+  }
+}
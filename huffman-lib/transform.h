@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace huffman::detail {
+// Burrows-Wheeler transform of [first, last) with an implicit end of block
+// char, smaller than all the others. Writes last - first chars to out, the
+// last column without the end char, and returns its row, in [1, size].
+uint32_t bwt_forward(char const* first, char const* last, char* out);
+// inverse of bwt_forward, writes last - first chars to out, throws
+// std::invalid_argument if the input isn't a transform
+void bwt_inverse(char const* first, char const* last, uint32_t primary,
+                 char* out);
+
+// move-to-front indices of chars in [first, last) are appended to dst, runs
+// of zero indices as their lengths in bijective base 2 with digits 0 and 1,
+// other indices i as i + 1 and i >= 254 as 255 followed by i - 254
+void mtf_encode(char const* first, char const* last, std::vector<char>& dst);
+// inverse of mtf_encode, which has to fill [out, out_end) exactly, throws
+// std::invalid_argument otherwise
+void mtf_decode(char const* first, char const* last, char* out, char* out_end);
+} // namespace huffman::detail
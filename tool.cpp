@@ -1,6 +1,443 @@
 #include "argagg/argagg.hpp"
 #include "huffman-lib/huffman.h"
+#include <chrono>
 #include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <future>
+#include <streambuf>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HUFFMAN_TOOL_MMAP
+#endif
+
+// defined by the build when liburing is found
+#ifdef HUFFMAN_TOOL_IO_URING
+#include <liburing.h>
+#endif
+
+namespace {
+void print_stats(std::ostream& os, huffman::stats const& s) {
+  auto ms = [](std::chrono::nanoseconds t) {
+    return std::chrono::duration<double, std::milli>(t).count();
+  };
+  os << "bytes in: " << s.bytes_in << "\n"
+     << "bytes out: " << s.bytes_out << "\n"
+     << "blocks: " << s.blocks << "\n"
+     << "average code length: " << s.average_code_length() << " bits\n"
+     << "slow path chars: " << s.slow_path_chars << "\n"
+     << "reused tables: " << s.reused_tables << "\n"
+     << "histogram: " << ms(s.histogram) << " ms\n"
+     << "code lengths: " << ms(s.code_lengths) << " ms\n"
+     << "canonical codes: " << ms(s.canonical_codes) << " ms\n"
+     << "bit packing: " << ms(s.bit_packing) << " ms\n"
+     << "decoding tables: " << ms(s.decoding_tables) << " ms\n"
+     << "decoding: " << ms(s.decoding) << " ms\n"
+     << "checksums: " << ms(s.checksums) << " ms\n"
+     << "stream io: " << ms(s.io) << " ms\n"
+     << "transform: " << ms(s.transform) << " ms\n";
+}
+
+#ifdef HUFFMAN_TOOL_MMAP
+std::system_error system_error(std::string const& what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+struct file_descriptor {
+  explicit file_descriptor(int fd) : fd(fd) {}
+  file_descriptor(file_descriptor const&) = delete;
+  file_descriptor& operator=(file_descriptor const&) = delete;
+  ~file_descriptor() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  int fd;
+};
+
+struct mapping {
+  mapping(int fd, size_t size, int prot, int flags) : size(size) {
+    if (size == 0) {
+      return;
+    }
+    void* p = mmap(nullptr, size, prot, flags, fd, 0);
+    if (p == MAP_FAILED) {
+      throw system_error("mmap failed");
+    }
+    data = static_cast<uint8_t*>(p);
+  }
+  mapping(mapping const&) = delete;
+  mapping& operator=(mapping const&) = delete;
+  ~mapping() {
+    if (data) {
+      munmap(data, size);
+    }
+  }
+
+  uint8_t* data{nullptr};
+  size_t size;
+};
+
+void write_all(int fd, uint8_t const* data, size_t size, std::string const& fname) {
+  for (off_t offset = 0; size > 0;) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written < 0 && errno == ESPIPE) {
+      written = write(fd, data, size);
+    }
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw system_error("failed to write " + fname);
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+// reads and writes of the background I/O buffers
+constexpr size_t IO_BUFFER_SIZE = size_t{1} << 20;
+
+// a single read or write of fd in the background, on io_uring when the
+// tool is built with liburing and the kernel supports it, otherwise on a
+// thread of its own
+class background_io {
+public:
+  explicit background_io(int fd) : fd(fd) {
+    seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+#ifdef HUFFMAN_TOOL_IO_URING
+    uring = io_uring_queue_init(2, &ring, 0) == 0;
+#endif
+  }
+  background_io(background_io const&) = delete;
+  background_io& operator=(background_io const&) = delete;
+  ~background_io() {
+    try {
+      wait();
+    } catch (std::exception const&) {
+    }
+#ifdef HUFFMAN_TOOL_IO_URING
+    if (uring) {
+      io_uring_queue_exit(&ring);
+    }
+#endif
+  }
+
+  void start_read(char* data, size_t size) {
+    start(data, size, false);
+  }
+
+  void start_write(char const* data, size_t size) {
+    start(const_cast<char*>(data), size, true);
+  }
+
+  // bytes read by the started read, 0 at end of file; a started write is
+  // complete on return
+  size_t wait() {
+    if (!busy) {
+      return 0;
+    }
+    busy = false;
+#ifdef HUFFMAN_TOOL_IO_URING
+    if (uring) {
+      for (;;) {
+        size_t n{wait_uring()};
+        offset += n;
+        if (!writing || n == request.size) {
+          return n;
+        }
+        // short writes go on with the rest
+        request.data += n;
+        request.size -= n;
+        submit_uring();
+      }
+    }
+#endif
+    size_t n{pending.get()};
+    offset += n;
+    return n;
+  }
+
+private:
+  struct io_request {
+    char* data;
+    size_t size;
+  };
+
+  void start(char* data, size_t size, bool write) {
+    wait();
+    request = {data, size};
+    writing = write;
+    busy = true;
+#ifdef HUFFMAN_TOOL_IO_URING
+    if (uring) {
+      submit_uring();
+      return;
+    }
+#endif
+    pending = std::async(std::launch::async,
+                         [this, r = request, write] { return run(r, write); });
+  }
+
+  // whole request for writes, whatever comes first for reads
+  size_t run(io_request r, bool write) const {
+    size_t done{0};
+    while (done < r.size) {
+      ssize_t n = write ? ::write(fd, r.data + done, r.size - done)
+                        : ::read(fd, r.data + done, r.size - done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        throw system_error(write ? "write failed" : "read failed");
+      }
+      done += n;
+      if (!write) {
+        break;
+      }
+    }
+    return done;
+  }
+
+#ifdef HUFFMAN_TOOL_IO_URING
+  void submit_uring() {
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    // pipes take the current position
+    uint64_t at{seekable ? static_cast<uint64_t>(offset) : ~uint64_t{0}};
+    if (writing) {
+      io_uring_prep_write(sqe, fd, request.data,
+                          static_cast<unsigned>(request.size), at);
+    } else {
+      io_uring_prep_read(sqe, fd, request.data,
+                         static_cast<unsigned>(request.size), at);
+    }
+    if (io_uring_submit(&ring) < 0) {
+      throw system_error("io_uring submit failed");
+    }
+  }
+
+  size_t wait_uring() {
+    for (;;) {
+      io_uring_cqe* cqe;
+      int ret = io_uring_wait_cqe(&ring, &cqe);
+      if (ret == -EINTR) {
+        continue;
+      }
+      if (ret < 0) {
+        errno = -ret;
+        throw system_error("io_uring wait failed");
+      }
+      int res = cqe->res;
+      io_uring_cqe_seen(&ring, cqe);
+      if (res == -EINTR || res == -EAGAIN) {
+        submit_uring();
+        continue;
+      }
+      if (res < 0) {
+        errno = -res;
+        throw system_error(writing ? "write failed" : "read failed");
+      }
+      return static_cast<size_t>(res);
+    }
+  }
+
+  io_uring ring;
+  bool uring{false};
+#endif
+
+  int fd;
+  bool seekable;
+  off_t offset{0};
+  io_request request{nullptr, 0};
+  bool writing{false};
+  bool busy{false};
+  std::future<size_t> pending;
+};
+
+// input read ahead, the next buffer is read in the background while the
+// caller takes chars of the current one
+class read_ahead_buf : public std::streambuf {
+public:
+  explicit read_ahead_buf(int fd)
+      : current(IO_BUFFER_SIZE), next(IO_BUFFER_SIZE), io(fd) {
+    io.start_read(next.data(), next.size());
+  }
+
+protected:
+  int_type underflow() override {
+    if (gptr() == egptr() && !eof) {
+      size_t n{io.wait()};
+      eof = n == 0;
+      std::swap(current, next);
+      setg(current.data(), current.data(), current.data() + n);
+      if (!eof) {
+        io.start_read(next.data(), next.size());
+      }
+    }
+    return gptr() == egptr() ? traits_type::eof()
+                             : traits_type::to_int_type(*gptr());
+  }
+
+private:
+  std::vector<char> current;
+  std::vector<char> next;
+  // destroyed first, it waits for the read in progress
+  background_io io;
+  bool eof{false};
+};
+
+// output written behind, a full buffer is written in the background while
+// the caller fills the other one; sync waits till all is written
+class write_behind_buf : public std::streambuf {
+public:
+  explicit write_behind_buf(int fd)
+      : current(IO_BUFFER_SIZE), other(IO_BUFFER_SIZE), io(fd) {
+    setp(current.data(), current.data() + current.size());
+  }
+
+protected:
+  int_type overflow(int_type ch) override {
+    write_buffer();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  int sync() override {
+    write_buffer();
+    io.wait();
+    return 0;
+  }
+
+private:
+  void write_buffer() {
+    if (pptr() != pbase()) {
+      io.start_write(pbase(), pptr() - pbase());
+      std::swap(current, other);
+      setp(current.data(), current.data() + current.size());
+    }
+  }
+
+  std::vector<char> current;
+  std::vector<char> other;
+  background_io io;
+};
+
+// streams files with reads and writes in the background, so that they
+// overlap coding instead of adding to it
+void process_async(std::string const& in_fname, std::string const& out_fname,
+                   bool compress, huffman::encode_options const& encode_options,
+                   huffman::decode_options const& decode_options) {
+  file_descriptor in{open(in_fname.c_str(), O_RDONLY)};
+  if (in.fd < 0) {
+    throw system_error("failed to open " + in_fname);
+  }
+  file_descriptor out{open(out_fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)};
+  if (out.fd < 0) {
+    throw system_error("failed to open " + out_fname);
+  }
+  read_ahead_buf in_buf(in.fd);
+  write_behind_buf out_buf(out.fd);
+  std::istream src(&in_buf);
+  std::ostream dst(&out_buf);
+  src.exceptions(std::istream::badbit);
+  dst.exceptions(std::ostream::badbit);
+  if (compress) {
+    huffman::encode(src, dst, encode_options);
+  } else {
+    huffman::decode(src, dst, decode_options);
+  }
+  dst.flush();
+}
+
+// maps the input file and writes output either through a mapping
+// preallocated to max_compressed_size or with pwrite, returns false without
+// touching the output if input isn't a regular file
+bool process_mapped(std::string const& in_fname, std::string const& out_fname,
+                    bool compress, huffman::encode_options const& encode_options,
+                    huffman::decode_options const& decode_options) {
+  file_descriptor in{open(in_fname.c_str(), O_RDONLY)};
+  if (in.fd < 0) {
+    throw system_error("failed to open " + in_fname);
+  }
+  struct stat in_stat;
+  if (fstat(in.fd, &in_stat) != 0) {
+    throw system_error("failed to stat " + in_fname);
+  }
+  if (!S_ISREG(in_stat.st_mode)) {
+    return false;
+  }
+  mapping src{in.fd, static_cast<size_t>(in_stat.st_size), PROT_READ, MAP_PRIVATE};
+  if (src.data) {
+    madvise(src.data, src.size, MADV_SEQUENTIAL);
+  }
+
+  file_descriptor out{open(out_fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666)};
+  if (out.fd < 0) {
+    throw system_error("failed to open " + out_fname);
+  }
+  struct stat out_stat;
+  if (fstat(out.fd, &out_stat) != 0) {
+    throw system_error("failed to stat " + out_fname);
+  }
+  if (compress && S_ISREG(out_stat.st_mode)) {
+    size_t capacity = huffman::max_compressed_size(src.size, encode_options);
+    if (ftruncate(out.fd, capacity) != 0) {
+      throw system_error("failed to resize " + out_fname);
+    }
+    size_t size;
+    {
+      mapping dst{out.fd, capacity, PROT_READ | PROT_WRITE, MAP_SHARED};
+      size = huffman::encode(src.data, src.size, dst.data, capacity, encode_options);
+    }
+    if (ftruncate(out.fd, size) != 0) {
+      throw system_error("failed to resize " + out_fname);
+    }
+    return true;
+  }
+  std::vector<uint8_t> dst;
+  if (compress) {
+    huffman::encode(src.data, src.size, dst, encode_options);
+  } else {
+    huffman::decode(src.data, src.size, dst, decode_options);
+  }
+  write_all(out.fd, dst.data(), dst.size(), out_fname);
+  return true;
+}
+#else
+void process_streams(std::string const& in_fname, std::string const& out_fname,
+                     bool compress, huffman::encode_options const& encode_options,
+                     huffman::decode_options const& decode_options) {
+  std::ifstream inf;
+  inf.exceptions(std::ifstream::badbit);
+  inf.open(in_fname, std::ios::binary);
+  if (!inf.is_open()) {
+    throw std::runtime_error("Failed to open " + in_fname);
+  }
+  std::ofstream outf;
+  outf.exceptions(std::ofstream::badbit);
+  outf.open(out_fname, std::ios::binary);
+  if (!outf.is_open()) {
+    throw std::runtime_error("Failed to open " + out_fname);
+  }
+  if (compress) {
+    huffman::encode(inf, outf, encode_options);
+  } else {
+    huffman::decode(inf, outf, decode_options);
+  }
+}
+#endif
+} // namespace
 
 int main(int argc, char const** argv) {
   try {
@@ -9,6 +446,17 @@ int main(int argc, char const** argv) {
         {"decompress", {"--decompress"}, "decompress a file", 0},
         {"input", {"--input"}, "specify input file", 1},
         {"output", {"--output"}, "specify output file", 1},
+        {"block-size", {"--block-size"}, "compression block size in bytes", 1},
+        {"threads", {"--threads"}, "number of worker threads, 0 for all cores", 1},
+        {"sample", {"--sample"}, "build codes from counts of this fraction of every block, in (0, 1]", 1},
+        {"adaptive", {"--adaptive"}, "end blocks where statistics of the data change, up to the block size", 0},
+        {"interleaved", {"--interleaved"}, "split blocks into 4 streams for faster decompression", 0},
+        {"order1", {"--order1"}, "code chars with tables chosen by the previous char where it's shorter", 0},
+        {"bwt", {"--bwt"}, "code chars Burrows-Wheeler transformed where it's shorter", 0},
+        {"checksums", {"--checksums"}, "store a checksum of every block", 0},
+        {"index", {"--index"}, "append an index of blocks for random access", 0},
+        {"no-mmap", {"--no-mmap"}, "stream files with reads and writes in the background", 0},
+        {"stats", {"--stats"}, "print sizes, counters and time of every phase", 0},
         {"help", {"-h", "--help"}, "shows this help message", 0},
     }};
     argagg::parser_results args = argparser.parse(argc, argv);
@@ -35,24 +483,38 @@ int main(int argc, char const** argv) {
     }
     std::string in_fname{args["input"].as<std::string>()};
     std::string out_fname{args["output"].as<std::string>()};
-    std::ifstream inf;
-    inf.exceptions(std::ifstream::badbit);
-    inf.open(in_fname);
-    if (!inf.is_open()) {
-      std::cerr << "Failed to open " << in_fname << '\n';
-      return EXIT_FAILURE;
+    bool compress{static_cast<bool>(args["compress"])};
+    size_t threads{args["threads"].as<size_t>(1)};
+    huffman::encode_options encode_options;
+    encode_options.block_size =
+        args["block-size"].as<size_t>(huffman::DEFAULT_BLOCK_SIZE);
+    encode_options.threads = threads;
+    encode_options.sample_fraction = args["sample"].as<double>(1);
+    encode_options.adaptive = static_cast<bool>(args["adaptive"]);
+    encode_options.interleaved = static_cast<bool>(args["interleaved"]);
+    encode_options.order1 = static_cast<bool>(args["order1"]);
+    encode_options.bwt = static_cast<bool>(args["bwt"]);
+    encode_options.checksums = static_cast<bool>(args["checksums"]);
+    encode_options.index = static_cast<bool>(args["index"]);
+    huffman::decode_options decode_options;
+    decode_options.threads = threads;
+    huffman::stats stats;
+    if (args["stats"]) {
+      encode_options.stats = &stats;
+      decode_options.stats = &stats;
     }
-    std::ofstream outf;
-    outf.exceptions(std::ofstream::badbit);
-    outf.open(out_fname);
-    if (!outf.is_open()) {
-      std::cerr << "Failed to open " << out_fname << '\n';
-      return EXIT_FAILURE;
+#ifdef HUFFMAN_TOOL_MMAP
+    if (args["no-mmap"] || !process_mapped(in_fname, out_fname, compress,
+                                           encode_options, decode_options)) {
+      process_async(in_fname, out_fname, compress, encode_options,
+                    decode_options);
     }
-    if (args["compress"]) {
-      huffman::encode(inf, outf);
-    } else {
-      huffman::decode(inf, outf);
+#else
+    process_streams(in_fname, out_fname, compress, encode_options,
+                    decode_options);
+#endif
+    if (args["stats"]) {
+      print_stats(std::cerr, stats);
     }
   } catch (const std::exception& e) {
     std::cerr << e.what() << '\n';
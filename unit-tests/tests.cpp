@@ -1,9 +1,21 @@
 #include "gtest/gtest.h"
 #include "../huffman-lib/huffman.h"
+#include "../huffman-lib/cpu.h"
+#include "../huffman-lib/transform.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <bitset>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <numeric>
 #include <random>
+#include <utility>
 #include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 
 template<typename Coll>
@@ -107,6 +119,28 @@ TEST(correctness, random_bytes) {
   }
 }
 
+TEST(correctness, chunk_boundaries) {
+  // 16 chars of 4 bit codes put message ends around 64 KiB units of input
+  std::default_random_engine eng(42);
+  std::uniform_int_distribution<char> random_char('a', 'p');
+  std::string s;
+  for (size_t i = 0; i < 4 * (1 << 16) + 64; i++) {
+    s.push_back(random_char(eng));
+  }
+  for (size_t size : {size_t{2} << 16, (size_t{2} << 16) + 15, (size_t{4} << 16) - 17,
+                      (size_t{4} << 16) + 64}) {
+    std::stringstream s1(s.substr(0, size)), s2, s3;
+    huffman::encode(s1, s2);
+    huffman::stats stats;
+    huffman::decode_options options;
+    options.stats = &stats;
+    huffman::decode(s2, s3, options);
+    EXPECT_EQ(s3.str(), s1.str());
+    EXPECT_EQ(stats.bytes_in, s2.str().size());
+    EXPECT_EQ(stats.bytes_out, size);
+  }
+}
+
 TEST(compression_ratio, fibonacci) {
   constexpr size_t N = 100'000;
   std::array<size_t, N> fib;
@@ -179,3 +213,1769 @@ TEST(performance, random_bytes) {
   huffman::encode(s1, s2);
   huffman::decode(s2, s3);
 }
+
+namespace {
+// input that can be read only once, like a pipe
+struct forward_only_buf : std::streambuf {
+  explicit forward_only_buf(std::string const& data) : data(data) {
+    char* p = const_cast<char*>(this->data.data());
+    setg(p, p, p + this->data.size());
+  }
+
+  std::string data;
+};
+
+std::string random_string(size_t length, char min, char max, unsigned seed = 42) {
+  std::default_random_engine eng(seed);
+  std::uniform_int_distribution<char> random_char(min, max);
+  std::string s;
+  for (size_t i = 0; i < length; i++) {
+    s.push_back(random_char(eng));
+  }
+  return s;
+}
+
+std::string encode_blocks(std::string const& data, huffman::encode_options const& options = {}) {
+  forward_only_buf buf(data);
+  std::istream src(&buf);
+  std::stringstream dst;
+  huffman::encode(src, dst, options);
+  return dst.str();
+}
+
+std::string decode_string(std::string const& data, huffman::decode_options const& options = {}) {
+  std::stringstream src(data), dst;
+  huffman::decode(src, dst, options);
+  return dst.str();
+}
+
+std::string encode_single(std::string const& data) {
+  std::stringstream src(data), dst;
+  huffman::encode(src, dst);
+  return dst.str();
+}
+} // namespace
+
+TEST(block_mode, empty_stream) {
+  EXPECT_TRUE(decode_string(encode_blocks("")).empty());
+}
+
+TEST(block_mode, single_char) {
+  const std::string s(5000, 'a');
+  std::string encoded = encode_blocks(s);
+  EXPECT_EQ(decode_string(encoded), s);
+  EXPECT_GE(s.size(), 5 * encoded.size());
+}
+
+TEST(block_mode, many_blocks) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = random_string(10 * options.block_size + 123, 'a', 'z');
+  // change distribution between blocks
+  for (size_t i = 0; i < s.size(); i += 3 * options.block_size) {
+    std::fill_n(s.begin() + i, std::min(options.block_size, s.size() - i), 'x');
+  }
+  std::string encoded = encode_blocks(s, options);
+  EXPECT_EQ(decode_string(encoded), s);
+  EXPECT_GE(s.size(), 1.5 * encoded.size());
+}
+
+TEST(block_mode, random_bytes) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = random_string(3 * options.block_size, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max());
+  EXPECT_EQ(decode_string(encode_blocks(s, options)), s);
+}
+
+TEST(block_mode, bad_block_size) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE - 1;
+  EXPECT_THROW(encode_blocks("abc", options), std::invalid_argument);
+  options.block_size = huffman::MAX_BLOCK_SIZE + 1;
+  EXPECT_THROW(encode_blocks("abc", options), std::invalid_argument);
+}
+
+TEST(block_mode, truncated_input) {
+  std::string encoded = encode_blocks(random_string(1000, 'a', 'z'));
+  for (size_t length : {size_t{4}, size_t{7}, encoded.size() / 2, encoded.size() - 1}) {
+    EXPECT_THROW(decode_string(encoded.substr(0, length)), std::invalid_argument);
+  }
+}
+
+TEST(block_mode, corrupted_message) {
+  std::string encoded = encode_blocks(random_string(1000, 'a', 'z'));
+  // flip bits in the middle of the only block
+  encoded[encoded.size() / 2] ^= 0x5a;
+  std::string decoded;
+  try {
+    decoded = decode_string(encoded);
+  } catch (std::invalid_argument const&) {
+    return;
+  }
+  EXPECT_NE(decoded, random_string(1000, 'a', 'z'));
+}
+
+TEST(block_mode, threads) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = random_string(20 * options.block_size + 7, 'a', 'k');
+  std::string expected = encode_blocks(s, options);
+  for (size_t threads : {2, 4, 0}) {
+    options.threads = threads;
+    std::string encoded = encode_blocks(s, options);
+    EXPECT_EQ(encoded, expected);
+    huffman::decode_options decode_options;
+    decode_options.threads = threads;
+    EXPECT_EQ(decode_string(encoded, decode_options), s);
+  }
+}
+
+TEST(block_mode, threads_corrupted_block) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  options.threads = 4;
+  std::string encoded = encode_blocks(random_string(8 * options.block_size, 'a', 'k'), options);
+  // break the code lengths of the first block
+  encoded[6 + 9] = 1;
+  encoded[6 + 10] = 1;
+  huffman::decode_options decode_options;
+  decode_options.threads = 4;
+  EXPECT_THROW(decode_string(encoded, decode_options), std::invalid_argument);
+}
+
+namespace {
+// fibonacci distributed chars give codes much longer than the lookup table
+std::string skewed_string(size_t symbols = 25) {
+  std::string s;
+  size_t a = 1, b = 1;
+  for (size_t i = 0; i < symbols; i++) {
+    s.append(a, static_cast<char>('A' + i));
+    b = std::exchange(a, a + b);
+  }
+  std::shuffle(s.begin(), s.end(), std::default_random_engine(42));
+  return s;
+}
+
+// compact code lengths of the first block follow stream and block headers
+constexpr size_t LENGTHS_OFFSET = 6 + 9;
+
+// unpacks the shortest length plus width bits long differences of chars
+// marked in the bitmap, sets size of the packed lengths
+std::string first_block_lengths(std::string const& encoded, size_t& size) {
+  std::string header = encoded.substr(LENGTHS_OFFSET);
+  size_t min_length = static_cast<unsigned char>(header[0]);
+  size_t width = static_cast<unsigned char>(header[1]);
+  std::string lengths(256, 0);
+  size_t bit = 8 * (2 + 32);
+  for (size_t i = 0; i < lengths.size(); i++) {
+    if ((static_cast<unsigned char>(header[2 + i / 8]) >> (i % 8) & 1) == 0) {
+      continue;
+    }
+    size_t diff = 0;
+    for (size_t j = 0; j < width; j++, bit++) {
+      diff = diff << 1 | (static_cast<unsigned char>(header[bit / 8]) >> (7 - bit % 8) & 1);
+    }
+    lengths[i] = static_cast<char>(min_length + diff);
+  }
+  size = (bit + 7) / 8;
+  return lengths;
+}
+
+std::string first_block_lengths(std::string const& encoded) {
+  size_t size;
+  return first_block_lengths(encoded, size);
+}
+} // namespace
+
+TEST(table_decoder, long_codes) {
+  std::string s = skewed_string();
+  std::stringstream single_src(s), single;
+  huffman::encode(single_src, single);
+  std::string blocks = encode_blocks(s);
+  for (size_t table_bits : {huffman::MIN_TABLE_BITS, huffman::DEFAULT_TABLE_BITS,
+                            huffman::MAX_TABLE_BITS}) {
+    huffman::decode_options options;
+    options.table_bits = table_bits;
+    EXPECT_EQ(decode_string(single.str(), options), s);
+    EXPECT_EQ(decode_string(blocks, options), s);
+  }
+}
+
+// every table width, with codes both all in the table and longer
+TEST(table_decoder, every_kernel) {
+  std::string s = skewed_string(16) + random_string(20'000, 'a', 'z');
+  for (size_t limit : {8, 12, 16}) {
+    for (bool interleaved : {false, true}) {
+      huffman::encode_options encode_options;
+      encode_options.code_length_limit = limit;
+      encode_options.interleaved = interleaved;
+      std::string encoded = encode_blocks(s, encode_options);
+      for (size_t table_bits = huffman::MIN_TABLE_BITS; table_bits <= huffman::MAX_TABLE_BITS;
+           table_bits++) {
+        huffman::decode_options options;
+        options.table_bits = table_bits;
+        huffman::stats stats;
+        options.stats = &stats;
+        EXPECT_EQ(decode_string(encoded, options), s);
+        EXPECT_EQ(stats.slow_path_chars > 0, limit > table_bits);
+      }
+    }
+  }
+}
+
+// portable kernels and the variants of the machine decode the same
+TEST(table_decoder, cpu_variants) {
+  std::string s = skewed_string(16) + random_string(200'000, 'a', 'z');
+  huffman::detail::cpu_features detected = huffman::detail::cpu();
+  for (bool interleaved : {false, true}) {
+    huffman::encode_options encode_options;
+    encode_options.interleaved = interleaved;
+    encode_options.code_length_limit = 14;
+    std::string encoded = encode_blocks(s, encode_options);
+    for (size_t table_bits : {huffman::MIN_TABLE_BITS, huffman::MAX_TABLE_BITS}) {
+      huffman::decode_options options;
+      options.table_bits = table_bits;
+      huffman::detail::set_cpu({});
+      EXPECT_EQ(decode_string(encoded, options), s);
+      huffman::detail::set_cpu(detected);
+      EXPECT_EQ(decode_string(encoded, options), s);
+    }
+  }
+}
+
+// bits that aren't a code of a table holding all the codes
+TEST(table_decoder, incomplete_code) {
+  std::string s(1000, 'a');
+  std::string encoded = encode_single(s);
+  ASSERT_EQ(encoded.size(), 257 + 125);
+  for (size_t i : {size_t{257}, size_t{300}, encoded.size() - 1}) {
+    std::string corrupted = encoded;
+    corrupted[i] = static_cast<char>(0x10);
+    EXPECT_THROW(decode_string(corrupted), std::invalid_argument);
+  }
+}
+
+TEST(table_decoder, bad_table_bits) {
+  std::string encoded = encode_blocks("abc");
+  huffman::decode_options options;
+  options.table_bits = huffman::MIN_TABLE_BITS - 1;
+  EXPECT_THROW(decode_string(encoded, options), std::invalid_argument);
+  options.table_bits = huffman::MAX_TABLE_BITS + 1;
+  EXPECT_THROW(decode_string(encoded, options), std::invalid_argument);
+}
+
+TEST(length_limit, block_mode) {
+  std::string s = skewed_string();
+  size_t prev_size = std::numeric_limits<size_t>::max();
+  for (size_t limit : {size_t{8}, size_t{11}, size_t{15}, huffman::MAX_CODE_LENGTH_LIMIT}) {
+    huffman::encode_options options;
+    options.code_length_limit = limit;
+    std::string encoded = encode_blocks(s, options);
+    std::string lengths = first_block_lengths(encoded);
+    EXPECT_EQ(static_cast<size_t>(*std::max_element(lengths.begin(), lengths.end())),
+              std::min(limit, size_t{24}));
+    EXPECT_EQ(decode_string(encoded), s);
+    // looser limit never costs more
+    EXPECT_LE(encoded.size(), prev_size);
+    prev_size = encoded.size();
+  }
+}
+
+TEST(length_limit, single_table) {
+  std::string s = skewed_string();
+  std::stringstream src(s), dst;
+  huffman::encode(src, dst);
+  std::string lengths = dst.str().substr(0, 256);
+  EXPECT_EQ(static_cast<size_t>(*std::max_element(lengths.begin(), lengths.end())),
+            huffman::DEFAULT_CODE_LENGTH_LIMIT);
+  EXPECT_EQ(decode_string(dst.str()), s);
+}
+
+TEST(length_limit, all_chars) {
+  // every char is used, so the tightest limit gives 8 bit codes for all
+  std::string s;
+  for (size_t i = 0; i < 256; i++) {
+    s.append(i + 1, static_cast<char>(i));
+  }
+  huffman::encode_options options;
+  options.code_length_limit = huffman::MIN_CODE_LENGTH_LIMIT;
+  huffman::model m = huffman::model::train(reinterpret_cast<uint8_t const*>(s.data()), s.size(),
+                                           options);
+  std::vector<uint8_t> lengths;
+  m.save(lengths);
+  EXPECT_EQ(lengths, std::vector<uint8_t>(256, 8));
+  // such block doesn't get shorter, so it's stored raw
+  std::string encoded = encode_blocks(s, options);
+  EXPECT_EQ(encoded.size(), 6 + 9 + s.size() + 1);
+  EXPECT_EQ(decode_string(encoded), s);
+}
+
+TEST(length_limit, bad_limit) {
+  huffman::encode_options options;
+  options.code_length_limit = huffman::MIN_CODE_LENGTH_LIMIT - 1;
+  EXPECT_THROW(encode_blocks("abc", options), std::invalid_argument);
+  options.code_length_limit = huffman::MAX_CODE_LENGTH_LIMIT + 1;
+  EXPECT_THROW(encode_blocks("abc", options), std::invalid_argument);
+}
+
+namespace {
+std::vector<uint8_t> to_bytes(std::string const& s) {
+  return std::vector<uint8_t>(s.begin(), s.end());
+}
+} // namespace
+
+TEST(buffer_api, same_as_stream) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = random_string(5 * options.block_size + 17, 'a', 'p');
+  std::vector<uint8_t> encoded;
+  for (size_t threads : {1, 4}) {
+    options.threads = threads;
+    encoded.clear();
+    huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(), encoded, options);
+    EXPECT_EQ(encoded, to_bytes(encode_blocks(s, options)));
+    huffman::decode_options decode_options;
+    decode_options.threads = threads;
+    std::vector<uint8_t> decoded;
+    huffman::decode(encoded.data(), encoded.size(), decoded, decode_options);
+    EXPECT_EQ(decoded, to_bytes(s));
+  }
+}
+
+TEST(buffer_api, appends_to_vector) {
+  std::vector<uint8_t> s = to_bytes(random_string(1000, 'a', 'z'));
+  std::vector<uint8_t> encoded{1, 2, 3};
+  huffman::encode(s.data(), s.size(), encoded);
+  EXPECT_EQ(std::vector<uint8_t>(encoded.begin(), encoded.begin() + 3), (std::vector<uint8_t>{1, 2, 3}));
+  std::vector<uint8_t> decoded{4};
+  huffman::decode(encoded.data() + 3, encoded.size() - 3, decoded);
+  EXPECT_EQ(decoded.size(), s.size() + 1);
+  EXPECT_TRUE(std::equal(s.begin(), s.end(), decoded.begin() + 1));
+}
+
+TEST(buffer_api, single_table_input) {
+  std::string s = skewed_string();
+  std::stringstream src(s), dst;
+  huffman::encode(src, dst);
+  std::vector<uint8_t> encoded = to_bytes(dst.str());
+  std::vector<uint8_t> decoded;
+  huffman::decode(encoded.data(), encoded.size(), decoded);
+  EXPECT_EQ(decoded, to_bytes(s));
+
+  std::vector<uint8_t> fixed(s.size());
+  EXPECT_EQ(huffman::decode(encoded.data(), encoded.size(), fixed.data(), fixed.size()), s.size());
+  EXPECT_EQ(fixed, to_bytes(s));
+  EXPECT_THROW(huffman::decode(encoded.data(), encoded.size(), fixed.data(), fixed.size() - 1),
+               std::invalid_argument);
+  EXPECT_THROW(huffman::decode(encoded.data(), 100, decoded), std::invalid_argument);
+}
+
+TEST(buffer_api, max_compressed_size) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  for (size_t size : {size_t{0}, size_t{1}, size_t{1000}, 3 * options.block_size + 1}) {
+    for (std::string const& s : {random_string(size, std::numeric_limits<char>::min(),
+                                               std::numeric_limits<char>::max()),
+                                 std::string(size, 'a')}) {
+      std::vector<uint8_t> encoded(huffman::max_compressed_size(size, options));
+      size_t encoded_size = huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(),
+                                            encoded.data(), encoded.size(), options);
+      EXPECT_LE(encoded_size, encoded.size());
+      std::vector<uint8_t> decoded(size);
+      EXPECT_EQ(huffman::decode(encoded.data(), encoded_size, decoded.data(), decoded.size()), size);
+      EXPECT_EQ(decoded, to_bytes(s));
+    }
+  }
+}
+
+TEST(buffer_api, small_output_buffer) {
+  std::vector<uint8_t> s = to_bytes(random_string(1000, 'a', 'z'));
+  std::vector<uint8_t> encoded(huffman::max_compressed_size(s.size()));
+  size_t encoded_size = huffman::encode(s.data(), s.size(), encoded.data(), encoded.size());
+  EXPECT_THROW(huffman::encode(s.data(), s.size(), encoded.data(), encoded_size - 1),
+               std::invalid_argument);
+  std::vector<uint8_t> decoded(s.size() - 1);
+  EXPECT_THROW(huffman::decode(encoded.data(), encoded_size, decoded.data(), decoded.size()),
+               std::invalid_argument);
+}
+
+TEST(buffer_api, truncated_input) {
+  std::vector<uint8_t> s = to_bytes(random_string(1000, 'a', 'z'));
+  std::vector<uint8_t> encoded;
+  huffman::encode(s.data(), s.size(), encoded);
+  for (size_t length : {size_t{4}, size_t{7}, encoded.size() / 2, encoded.size() - 1}) {
+    std::vector<uint8_t> decoded;
+    EXPECT_THROW(huffman::decode(encoded.data(), length, decoded), std::invalid_argument);
+  }
+}
+
+TEST(histogram, matches_naive_count) {
+  std::string s = random_string(100'003, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max());
+  s.append(1000, 'z');
+  for (size_t offset : {0, 1, 7}) {
+    std::array<uint64_t, 256> expected{};
+    for (size_t i = offset; i < s.size(); i++) {
+      expected[static_cast<unsigned char>(s[i])]++;
+    }
+    std::array<uint64_t, 256> counts{};
+    huffman::histogram(reinterpret_cast<uint8_t const*>(s.data()) + offset, s.size() - offset,
+                       counts);
+    EXPECT_EQ(counts, expected);
+  }
+}
+
+TEST(histogram, adds_to_counts) {
+  std::array<uint64_t, 256> counts{};
+  counts['a'] = 5;
+  uint8_t const data[] = {'a', 'b', 'a'};
+  huffman::histogram(data, sizeof(data), counts);
+  EXPECT_EQ(counts['a'], 7);
+  EXPECT_EQ(counts['b'], 1);
+  EXPECT_EQ(std::accumulate(counts.begin(), counts.end(), uint64_t{0}), 8);
+}
+
+TEST(interleaved, round_trip) {
+  huffman::encode_options options;
+  options.interleaved = true;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  for (size_t size : {size_t{0}, size_t{1}, size_t{3}, size_t{5}, size_t{1001},
+                      3 * options.block_size + 2}) {
+    for (std::string const& s : {random_string(size, 'a', 'z'), std::string(size, 'a'),
+                                 random_string(size, std::numeric_limits<char>::min(),
+                                               std::numeric_limits<char>::max())}) {
+      std::string encoded = encode_blocks(s, options);
+      EXPECT_EQ(decode_string(encoded), s);
+      std::vector<uint8_t> buffer(huffman::max_compressed_size(size, options));
+      EXPECT_EQ(huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(),
+                                buffer.data(), buffer.size(), options),
+                encoded.size());
+    }
+  }
+}
+
+TEST(interleaved, long_codes) {
+  huffman::encode_options options;
+  options.interleaved = true;
+  options.code_length_limit = huffman::MAX_CODE_LENGTH_LIMIT;
+  std::string s = skewed_string();
+  std::string encoded = encode_blocks(s, options);
+  huffman::decode_options decode_options;
+  decode_options.table_bits = huffman::MIN_TABLE_BITS;
+  EXPECT_EQ(decode_string(encoded, decode_options), s);
+}
+
+TEST(interleaved, threads) {
+  huffman::encode_options options;
+  options.interleaved = true;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  options.threads = 4;
+  std::vector<uint8_t> s = to_bytes(random_string(9 * options.block_size + 5, 'a', 'k'));
+  std::vector<uint8_t> encoded;
+  huffman::encode(s.data(), s.size(), encoded, options);
+  huffman::decode_options decode_options;
+  decode_options.threads = 4;
+  std::vector<uint8_t> decoded;
+  huffman::decode(encoded.data(), encoded.size(), decoded, decode_options);
+  EXPECT_EQ(decoded, s);
+}
+
+TEST(interleaved, corrupted_jump_table) {
+  huffman::encode_options options;
+  options.interleaved = true;
+  std::string encoded = encode_blocks(random_string(1000, 'a', 'z'), options);
+  // stream sizes follow code lengths
+  size_t lengths_size;
+  first_block_lengths(encoded, lengths_size);
+  size_t offset = LENGTHS_OFFSET + lengths_size;
+  for (size_t i = 0; i < 3; i++) {
+    std::string corrupted = encoded;
+    corrupted[offset + 4 * i] ^= 1;
+    EXPECT_THROW(decode_string(corrupted), std::invalid_argument);
+  }
+  encoded[offset + 3] = static_cast<char>(0xFF);
+  EXPECT_THROW(decode_string(encoded), std::invalid_argument);
+}
+
+namespace {
+std::vector<std::string> json_messages(size_t count) {
+  std::vector<std::string> messages;
+  std::default_random_engine eng(42);
+  std::uniform_int_distribution<int> id(0, 1'000'000);
+  for (size_t i = 0; i < count; i++) {
+    messages.push_back("{\"id\":" + std::to_string(id(eng)) + ",\"name\":\"" +
+                       random_string(8, 'a', 'z', static_cast<unsigned>(i)) +
+                       "\",\"active\":true}");
+  }
+  return messages;
+}
+
+std::string join(std::vector<std::string> const& messages) {
+  std::string s;
+  for (std::string const& m : messages) {
+    s += m;
+  }
+  return s;
+}
+} // namespace
+
+TEST(model, round_trip) {
+  std::vector<std::string> messages = json_messages(200);
+  std::string samples = join(messages);
+  huffman::model m = huffman::model::train(reinterpret_cast<uint8_t const*>(samples.data()),
+                                           samples.size());
+  size_t total = 0;
+  for (std::string const& msg : messages) {
+    std::vector<uint8_t> encoded;
+    m.encode(reinterpret_cast<uint8_t const*>(msg.data()), msg.size(), encoded);
+    total += encoded.size();
+    std::vector<uint8_t> decoded;
+    m.decode(encoded.data(), encoded.size(), decoded);
+    EXPECT_EQ(decoded, to_bytes(msg));
+  }
+  EXPECT_GE(samples.size(), 1.5 * total);
+}
+
+TEST(model, bytes_missing_from_samples) {
+  std::string samples(100, 'a');
+  huffman::model m = huffman::model::train(reinterpret_cast<uint8_t const*>(samples.data()),
+                                           samples.size());
+  for (std::string const& msg : {std::string(), std::string("b"),
+                                 random_string(1000, std::numeric_limits<char>::min(),
+                                               std::numeric_limits<char>::max())}) {
+    std::vector<uint8_t> encoded{7};
+    m.encode(reinterpret_cast<uint8_t const*>(msg.data()), msg.size(), encoded);
+    std::vector<uint8_t> decoded{9};
+    m.decode(encoded.data() + 1, encoded.size() - 1, decoded);
+    EXPECT_EQ(decoded.size(), msg.size() + 1);
+    EXPECT_TRUE(std::equal(msg.begin(), msg.end(), decoded.begin() + 1,
+                           [](char a, uint8_t b) { return static_cast<uint8_t>(a) == b; }));
+  }
+}
+
+TEST(model, save_and_load) {
+  std::string samples = join(json_messages(50));
+  huffman::model trained = huffman::model::train(
+      reinterpret_cast<uint8_t const*>(samples.data()), samples.size());
+  std::vector<uint8_t> saved;
+  trained.save(saved);
+  EXPECT_EQ(saved.size(), 256);
+  huffman::model loaded = huffman::model::load(saved.data(), saved.size());
+  std::vector<uint8_t> resaved;
+  loaded.save(resaved);
+  EXPECT_EQ(resaved, saved);
+
+  std::vector<uint8_t> encoded;
+  trained.encode(reinterpret_cast<uint8_t const*>(samples.data()), samples.size(), encoded);
+  std::vector<uint8_t> decoded;
+  loaded.decode(encoded.data(), encoded.size(), decoded);
+  EXPECT_EQ(decoded, to_bytes(samples));
+
+  EXPECT_THROW(huffman::model::load(saved.data(), saved.size() - 1), std::invalid_argument);
+  saved[3] = 0;
+  EXPECT_THROW(huffman::model::load(saved.data(), saved.size()), std::invalid_argument);
+  saved[3] = 1;
+  EXPECT_THROW(huffman::model::load(saved.data(), saved.size()), std::invalid_argument);
+}
+
+TEST(model, corrupted_message) {
+  std::string msg = join(json_messages(3));
+  huffman::model m = huffman::model::train(reinterpret_cast<uint8_t const*>(msg.data()),
+                                           msg.size());
+  std::vector<uint8_t> encoded;
+  m.encode(reinterpret_cast<uint8_t const*>(msg.data()), msg.size(), encoded);
+  std::vector<uint8_t> decoded;
+  EXPECT_THROW(m.decode(encoded.data(), encoded.size() - 1, decoded), std::invalid_argument);
+  EXPECT_THROW(m.decode(encoded.data(), 0, decoded), std::invalid_argument);
+  // huge size that the message can't hold
+  std::vector<uint8_t> bad_size{0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0};
+  EXPECT_THROW(m.decode(bad_size.data(), bad_size.size(), decoded), std::invalid_argument);
+}
+
+TEST(model, shared_between_threads) {
+  std::vector<std::string> messages = json_messages(400);
+  std::string samples = join(messages);
+  huffman::model m = huffman::model::train(reinterpret_cast<uint8_t const*>(samples.data()),
+                                           samples.size());
+  std::vector<std::thread> threads;
+  // separate flags, since threads write them at once
+  std::array<bool, 4> ok{true, true, true, true};
+  for (size_t t = 0; t < ok.size(); t++) {
+    threads.emplace_back([&, t]() {
+      huffman::model copy = m;
+      for (size_t i = t; i < messages.size(); i += ok.size()) {
+        std::vector<uint8_t> encoded, decoded;
+        copy.encode(reinterpret_cast<uint8_t const*>(messages[i].data()), messages[i].size(),
+                    encoded);
+        copy.decode(encoded.data(), encoded.size(), decoded);
+        ok[t] = ok[t] && decoded == to_bytes(messages[i]);
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  EXPECT_TRUE(std::all_of(ok.begin(), ok.end(), [](bool x) { return x; }));
+}
+
+TEST(compact_header, small_alphabet) {
+  std::string s = random_string(2000, 'a', 'b');
+  std::string encoded = encode_blocks(s);
+  size_t lengths_size;
+  std::string lengths = first_block_lengths(encoded, lengths_size);
+  EXPECT_EQ(lengths_size, 2 + 32 + 0);
+  EXPECT_EQ(std::count(lengths.begin(), lengths.end(), 1), 2);
+  // 1 bit per char besides headers and end of stream
+  EXPECT_EQ(encoded.size(), LENGTHS_OFFSET + lengths_size + s.size() / 8 + 1);
+  EXPECT_EQ(decode_string(encoded), s);
+}
+
+TEST(compact_header, decodes_version_1) {
+  // version 1 block payload has the same 256 code lengths as single table
+  // format, which is followed by ignore_bits and the message
+  std::string s = random_string(3000, 'a', 'z');
+  std::stringstream src(s), single;
+  huffman::encode(src, single);
+  std::string payload = single.str().substr(0, 256) + single.str().substr(257);
+  std::string encoded = std::string("\xFFHUF\x01\x00", 6) + '\x01';
+  for (size_t size : {s.size(), payload.size()}) {
+    for (size_t i = 0; i < 4; i++) {
+      encoded.push_back(static_cast<char>(size >> (8 * i)));
+    }
+  }
+  encoded += payload + '\0';
+  EXPECT_EQ(decode_string(encoded), s);
+  std::vector<uint8_t> decoded;
+  huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(), decoded);
+  EXPECT_EQ(decoded, to_bytes(s));
+}
+
+TEST(compact_header, corrupted_lengths) {
+  std::string encoded = encode_blocks(random_string(1000, 'a', 'z'));
+  std::string bad_width = encoded;
+  bad_width[LENGTHS_OFFSET + 1] = 6;
+  EXPECT_THROW(decode_string(bad_width), std::invalid_argument);
+  std::string bad_min = encoded;
+  bad_min[LENGTHS_OFFSET] = 0;
+  EXPECT_THROW(decode_string(bad_min), std::invalid_argument);
+  std::string bad_version = encoded;
+  bad_version[4] = 3;
+  EXPECT_THROW(decode_string(bad_version), std::invalid_argument);
+}
+
+TEST(fallback_blocks, raw) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = random_string(3 * options.block_size + 10, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max());
+  std::string encoded = encode_blocks(s, options);
+  EXPECT_EQ(encoded.size(), 6 + 4 * 9 + s.size() + 1);
+  EXPECT_EQ(encoded[6], 3);
+  EXPECT_EQ(encoded.substr(6 + 9, 100), s.substr(0, 100));
+  EXPECT_EQ(decode_string(encoded), s);
+  std::vector<uint8_t> buffer(huffman::max_compressed_size(s.size(), options));
+  EXPECT_EQ(huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(), buffer.data(),
+                            buffer.size(), options),
+            buffer.size());
+}
+
+TEST(fallback_blocks, run) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s(2 * options.block_size, 'x');
+  s.append(options.block_size, 'y');
+  std::string encoded = encode_blocks(s, options);
+  EXPECT_EQ(encoded.size(), 6 + 3 * (9 + 1) + 1);
+  EXPECT_EQ(encoded[6], 4);
+  EXPECT_EQ(decode_string(encoded), s);
+}
+
+TEST(fallback_blocks, mixed) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  options.threads = 4;
+  std::string s = random_string(options.block_size, 'a', 'f') +
+                  std::string(options.block_size, 'z') +
+                  random_string(options.block_size, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max()) +
+                  "tail";
+  std::vector<uint8_t> encoded;
+  huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(), encoded, options);
+  EXPECT_EQ(encoded, to_bytes(encode_blocks(s, options)));
+  huffman::decode_options decode_options;
+  decode_options.threads = 4;
+  std::vector<uint8_t> decoded;
+  huffman::decode(encoded.data(), encoded.size(), decoded, decode_options);
+  EXPECT_EQ(decoded, to_bytes(s));
+}
+
+TEST(fallback_blocks, corrupted_sizes) {
+  std::string encoded = encode_blocks(std::string(1000, 'x'));
+  // run payload is a single char
+  std::string bad_run = encoded;
+  bad_run[6 + 5] = 2;
+  EXPECT_THROW(decode_string(bad_run), std::invalid_argument);
+  std::string raw = encode_blocks(random_string(1000, std::numeric_limits<char>::min(),
+                                                std::numeric_limits<char>::max()));
+  // raw payload has the size of the block
+  raw[6 + 1] ^= 1;
+  EXPECT_THROW(decode_string(raw), std::invalid_argument);
+}
+
+TEST(frame, checksum) {
+  // reference xxHash32 values
+  auto hash = [](std::string const& s) {
+    return huffman::checksum(reinterpret_cast<uint8_t const*>(s.data()), s.size());
+  };
+  EXPECT_EQ(hash(""), 0x02CC5D05u);
+  EXPECT_EQ(hash("a"), 0x550D7456u);
+  EXPECT_EQ(hash("abc"), 0x32D153FFu);
+  EXPECT_EQ(hash("Nobody inspects the spammish repetition"), 0xE2293B2Fu);
+}
+
+TEST(frame, round_trip) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = random_string(3 * options.block_size + 5, 'a', 'k') +
+                  std::string(options.block_size, 'x');
+  for (bool checksums : {false, true}) {
+    for (bool index : {false, true}) {
+      options.checksums = checksums;
+      options.index = index;
+      options.threads = 1 + 3 * index;
+      std::string encoded = encode_blocks(s, options);
+      EXPECT_EQ(static_cast<int>(encoded[5]), checksums + 2 * index);
+      std::vector<uint8_t> buffer;
+      huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(), buffer, options);
+      EXPECT_EQ(buffer, to_bytes(encoded));
+      EXPECT_LE(buffer.size(), huffman::max_compressed_size(s.size(), options));
+      EXPECT_EQ(decode_string(encoded), s);
+      std::vector<uint8_t> decoded;
+      huffman::decode(buffer.data(), buffer.size(), decoded);
+      EXPECT_EQ(decoded, to_bytes(s));
+    }
+  }
+}
+
+TEST(frame, checksum_mismatch) {
+  huffman::encode_options options;
+  options.checksums = true;
+  std::string s = random_string(1000, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max());
+  std::string encoded = encode_blocks(s, options);
+  // raw block data follows stream header and 13 bytes of block header
+  encoded[6 + 13 + 500] ^= 1;
+  EXPECT_THROW(decode_string(encoded), std::invalid_argument);
+  std::vector<uint8_t> decoded;
+  EXPECT_THROW(huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(),
+                               decoded),
+               std::invalid_argument);
+}
+
+TEST(frame, corrupted_index) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  options.index = true;
+  std::string s = random_string(2 * options.block_size, 'a', 'z');
+  std::string encoded = encode_blocks(s, options);
+  // size of the second block in the index, which ends with block count and magic
+  for (size_t pos : {encoded.size() - 8 - 4, encoded.size() - 8, encoded.size() - 1}) {
+    std::string corrupted = encoded;
+    corrupted[pos] ^= 1;
+    EXPECT_THROW(decode_string(corrupted), std::invalid_argument);
+    std::vector<uint8_t> decoded;
+    EXPECT_THROW(huffman::decode_range(reinterpret_cast<uint8_t const*>(corrupted.data()),
+                                       corrupted.size(), 0, s.size(), decoded),
+                 std::invalid_argument);
+  }
+}
+
+TEST(decode_range, matches_substr) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = random_string(5 * options.block_size + 321, 'a', 'p');
+  std::fill_n(s.begin() + 2 * options.block_size, options.block_size, 'q');
+  std::default_random_engine eng(7);
+  for (bool index : {false, true}) {
+    options.index = index;
+    options.checksums = index;
+    std::string encoded = encode_blocks(s, options);
+    std::vector<std::pair<size_t, size_t>> ranges{
+        {0, 0}, {0, s.size()}, {s.size(), 0}, {s.size() - 1, 1},
+        {options.block_size - 1, 2}, {options.block_size, options.block_size}};
+    for (size_t i = 0; i < 20; i++) {
+      size_t offset = std::uniform_int_distribution<size_t>(0, s.size())(eng);
+      size_t length = std::uniform_int_distribution<size_t>(0, s.size() - offset)(eng);
+      ranges.emplace_back(offset, length);
+    }
+    for (auto [offset, length] : ranges) {
+      std::vector<uint8_t> decoded{1};
+      huffman::decode_options decode_options;
+      decode_options.threads = 2;
+      huffman::decode_range(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(),
+                            offset, length, decoded, decode_options);
+      EXPECT_EQ(decoded, to_bytes('\x01' + s.substr(offset, length)));
+      std::stringstream src(encoded), dst;
+      huffman::decode_range(src, offset, length, dst);
+      EXPECT_EQ(dst.str(), s.substr(offset, length));
+    }
+  }
+}
+
+TEST(decode_range, out_of_bounds) {
+  std::string s = random_string(1000, 'a', 'z');
+  std::string encoded = encode_blocks(s);
+  std::vector<uint8_t> decoded;
+  auto data = reinterpret_cast<uint8_t const*>(encoded.data());
+  EXPECT_THROW(huffman::decode_range(data, encoded.size(), 1001, 0, decoded),
+               std::invalid_argument);
+  EXPECT_THROW(huffman::decode_range(data, encoded.size(), 500, 501, decoded),
+               std::invalid_argument);
+  EXPECT_THROW(huffman::decode_range(data, encoded.size() - 1, 0, 10, decoded),
+               std::invalid_argument);
+  // single table input has no blocks
+  std::stringstream src(s), single;
+  huffman::encode(src, single);
+  std::string single_data = single.str();
+  EXPECT_THROW(huffman::decode_range(reinterpret_cast<uint8_t const*>(single_data.data()),
+                                     single_data.size(), 0, 10, decoded),
+               std::invalid_argument);
+}
+
+namespace {
+// feeds data in pieces of given size
+template <typename Coder>
+std::vector<uint8_t> feed_pieces(Coder& coder, std::string const& data, size_t piece) {
+  std::vector<uint8_t> out;
+  for (size_t i = 0; i < data.size(); i += piece) {
+    size_t n = std::min(piece, data.size() - i);
+    coder.feed(reinterpret_cast<uint8_t const*>(data.data()) + i, n, out);
+  }
+  return out;
+}
+} // namespace
+
+TEST(incremental, same_as_buffer) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = skewed_string() + random_string(2 * options.block_size + 17, 'a', 'z') +
+                  std::string(options.block_size, 'x') +
+                  random_string(options.block_size, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max());
+  for (bool interleaved : {false, true}) {
+    options.interleaved = interleaved;
+    options.checksums = interleaved;
+    options.index = interleaved;
+    std::string encoded = encode_blocks(s, options);
+    for (size_t piece : {size_t{1} << 20, size_t{4096}, size_t{7}}) {
+      huffman::encoder encoder(options);
+      std::vector<uint8_t> out = feed_pieces(encoder, s, piece);
+      encoder.finish(out);
+      EXPECT_EQ(out, to_bytes(encoded));
+
+      huffman::decoder decoder;
+      std::vector<uint8_t> decoded = feed_pieces(decoder, encoded, piece);
+      EXPECT_NO_THROW(decoder.finish());
+      EXPECT_EQ(decoded, to_bytes(s));
+    }
+  }
+}
+
+TEST(incremental, single_bytes) {
+  std::string s = random_string(5000, 'a', 'f') + skewed_string(15);
+  std::string encoded = encode_blocks(s);
+  huffman::decoder decoder;
+  std::vector<uint8_t> decoded;
+  for (size_t i = 0; i < encoded.size(); i++) {
+    decoder.feed(reinterpret_cast<uint8_t const*>(encoded.data()) + i, 1, decoded);
+    // chars come out before the block is over
+    if (i == encoded.size() / 2) {
+      EXPECT_GT(decoded.size(), s.size() / 4);
+    }
+  }
+  decoder.finish();
+  EXPECT_EQ(decoded, to_bytes(s));
+}
+
+TEST(incremental, reused_for_next_stream) {
+  std::string s = random_string(1000, 'a', 'z');
+  huffman::encoder encoder;
+  huffman::decoder decoder;
+  for (size_t i = 0; i < 2; i++) {
+    std::vector<uint8_t> encoded = feed_pieces(encoder, s, 100);
+    encoder.finish(encoded);
+    EXPECT_EQ(encoded, to_bytes(encode_blocks(s)));
+    std::vector<uint8_t> decoded;
+    decoder.feed(encoded.data(), encoded.size(), decoded);
+    decoder.finish();
+    EXPECT_EQ(decoded, to_bytes(s));
+  }
+}
+
+TEST(incremental, bad_input) {
+  std::string s = random_string(1000, 'a', 'z');
+  std::string encoded = encode_blocks(s);
+  {
+    huffman::decoder decoder;
+    feed_pieces(decoder, encoded.substr(0, encoded.size() - 1), 10);
+    EXPECT_THROW(decoder.finish(), std::invalid_argument);
+  }
+  {
+    huffman::decoder decoder;
+    EXPECT_THROW(feed_pieces(decoder, encoded + 'x', 10), std::invalid_argument);
+  }
+  {
+    huffman::encode_options options;
+    options.checksums = true;
+    std::string corrupted = encode_blocks(s, options);
+    corrupted[corrupted.size() - 2] ^= 0x55;
+    huffman::decoder decoder;
+    EXPECT_THROW(feed_pieces(decoder, corrupted, 3), std::invalid_argument);
+  }
+  {
+    // single table input has no blocks to split it
+    std::stringstream src(s), single;
+    huffman::encode(src, single);
+    huffman::decoder decoder;
+    EXPECT_THROW(feed_pieces(decoder, single.str(), 10), std::invalid_argument);
+  }
+}
+
+TEST(stats, counts_sizes) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  options.interleaved = true;
+  options.index = true;
+  std::string s = random_string(3 * options.block_size, 'a', 'p') +
+                  std::string(options.block_size, 'x');
+  huffman::stats buffer_stats;
+  options.stats = &buffer_stats;
+  std::vector<uint8_t> encoded;
+  huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(), encoded, options);
+  EXPECT_EQ(buffer_stats.bytes_in, s.size());
+  EXPECT_EQ(buffer_stats.bytes_out, encoded.size());
+  EXPECT_EQ(buffer_stats.blocks, 4u);
+  EXPECT_EQ(buffer_stats.coded_chars, 3 * options.block_size);
+  // 16 equally likely chars, and a byte of padding at most in every stream
+  EXPECT_GE(buffer_stats.average_code_length(), 4);
+  EXPECT_LT(buffer_stats.average_code_length(), 4.01);
+  EXPECT_GT(buffer_stats.histogram.count(), 0);
+  EXPECT_GT(buffer_stats.bit_packing.count(), 0);
+
+  huffman::stats stream_stats;
+  options.stats = &stream_stats;
+  std::stringstream src(s), dst;
+  huffman::encode(src, dst, options);
+  EXPECT_EQ(stream_stats.bytes_in, buffer_stats.bytes_in);
+  EXPECT_EQ(stream_stats.bytes_out, buffer_stats.bytes_out);
+  EXPECT_EQ(stream_stats.code_bits, buffer_stats.code_bits);
+
+  huffman::stats decode_stats;
+  huffman::decode_options decode_options;
+  decode_options.stats = &decode_stats;
+  decode_options.threads = 2;
+  std::vector<uint8_t> decoded;
+  huffman::decode(encoded.data(), encoded.size(), decoded, decode_options);
+  std::stringstream decode_src(dst.str()), decode_dst;
+  huffman::decode(decode_src, decode_dst, decode_options);
+  EXPECT_EQ(decode_stats.bytes_in, 2 * encoded.size());
+  EXPECT_EQ(decode_stats.bytes_out, 2 * s.size());
+  EXPECT_EQ(decode_stats.blocks, 8u);
+  EXPECT_EQ(decode_stats.code_bits, 2 * buffer_stats.code_bits);
+  EXPECT_EQ(decode_stats.slow_path_chars, 0u);
+  EXPECT_GT(decode_stats.decoding.count(), 0);
+}
+
+TEST(stats, slow_path_chars) {
+  std::string s = skewed_string();
+  huffman::encode_options options;
+  options.code_length_limit = 20;
+  std::string encoded = encode_blocks(s, options);
+  huffman::stats decode_stats;
+  huffman::decode_options decode_options;
+  decode_options.stats = &decode_stats;
+  decode_options.table_bits = huffman::MIN_TABLE_BITS;
+  std::vector<uint8_t> decoded;
+  huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(), decoded,
+                  decode_options);
+  // only the rarest chars have codes longer than 8 bits
+  EXPECT_GT(decode_stats.slow_path_chars, 0u);
+  EXPECT_LT(decode_stats.slow_path_chars, s.size() / 100);
+
+  // codes never leave the lookup table
+  options.code_length_limit = huffman::MIN_TABLE_BITS;
+  encoded = encode_blocks(s, options);
+  decode_stats = {};
+  huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(), decoded,
+                  decode_options);
+  EXPECT_EQ(decode_stats.slow_path_chars, 0u);
+}
+
+TEST(order1, round_trip) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = join(json_messages(5000)) + random_string(1000, 'a', 'z') +
+                  std::string(options.block_size, 'x');
+  std::string order0 = encode_blocks(s, options);
+  options.order1 = true;
+  std::string encoded = encode_blocks(s, options);
+  // keys and punctuation follow each other in fixed order
+  EXPECT_LT(encoded.size(), order0.size() * 9 / 10);
+  EXPECT_EQ(decode_string(encoded), s);
+
+  options.checksums = true;
+  options.index = true;
+  options.threads = 2;
+  huffman::decode_options decode_options;
+  decode_options.threads = 2;
+  encoded = encode_blocks(s, options);
+  EXPECT_EQ(decode_string(encoded, decode_options), s);
+  huffman::decoder decoder;
+  std::vector<uint8_t> decoded = feed_pieces(decoder, encoded, 1000);
+  decoder.finish();
+  EXPECT_EQ(decoded, to_bytes(s));
+  std::vector<uint8_t> range;
+  huffman::decode_range(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(),
+                        100'000, 5000, range);
+  EXPECT_EQ(range, to_bytes(s.substr(100'000, 5000)));
+}
+
+TEST(order1, not_worse_than_order0) {
+  huffman::encode_options options;
+  std::string s = random_string(100'000, 'a', 'z');
+  std::string order0 = encode_blocks(s, options);
+  options.order1 = true;
+  // independent chars gain nothing from more tables
+  EXPECT_EQ(encode_blocks(s, options), order0);
+}
+
+TEST(order1, corrupted_context_map) {
+  huffman::encode_options options;
+  options.order1 = true;
+  std::string s = join(json_messages(500));
+  std::string encoded = encode_blocks(s, options);
+  // first block type follows magic, version and flags
+  ASSERT_EQ(encoded[6], 5);
+  // table beyond the ones stored
+  encoded[6 + 9] = static_cast<char>(0xFF);
+  EXPECT_THROW(decode_string(encoded), std::invalid_argument);
+}
+
+namespace {
+// random permutation of all the byte values, repeated with a few changes,
+// so that move-to-front indices take all the values too
+std::string repetitive_string(size_t length) {
+  std::string period(256, 0);
+  std::iota(period.begin(), period.end(), std::numeric_limits<char>::min());
+  std::shuffle(period.begin(), period.end(), std::default_random_engine(42));
+  std::string s;
+  while (s.size() < length) {
+    s += period;
+    s[s.size() / 3] = 'x';
+  }
+  s.resize(length);
+  return s;
+}
+} // namespace
+
+TEST(bwt, round_trip) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = join(json_messages(5000)) + repetitive_string(3 * options.block_size + 5) +
+                  std::string(options.block_size, 'x') + random_string(1000, 'a', 'z');
+  std::string order0 = encode_blocks(s, options);
+  options.bwt = true;
+  std::string encoded = encode_blocks(s, options);
+  EXPECT_LT(encoded.size(), order0.size() / 4);
+  EXPECT_EQ(decode_string(encoded), s);
+
+  options.order1 = true;
+  options.checksums = true;
+  options.index = true;
+  options.threads = 2;
+  encoded = encode_blocks(s, options);
+  huffman::decode_options decode_options;
+  decode_options.threads = 2;
+  EXPECT_EQ(decode_string(encoded, decode_options), s);
+  std::stringstream src(s), dst;
+  huffman::encode(src, dst, options);
+  EXPECT_EQ(dst.str(), encoded);
+  huffman::decoder decoder;
+  std::vector<uint8_t> decoded = feed_pieces(decoder, encoded, 1000);
+  decoder.finish();
+  EXPECT_EQ(decoded, to_bytes(s));
+  std::vector<uint8_t> range;
+  huffman::decode_range(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(),
+                        200'000, 5000, range);
+  EXPECT_EQ(range, to_bytes(s.substr(200'000, 5000)));
+}
+
+// encoder keeps short blocks raw, so transforms are checked by themselves
+TEST(bwt, short_inputs) {
+  for (std::string s : {std::string(), std::string("a"), std::string("ab"), std::string("ba"),
+                        std::string("aab"), std::string("abab"), std::string("banana"),
+                        repetitive_string(1000),
+                        std::string(1000, 'a') + 'b' + std::string(1000, 'a')}) {
+    std::string transformed(s.size(), 0);
+    uint32_t primary = huffman::detail::bwt_forward(s.data(), s.data() + s.size(),
+                                                    transformed.data());
+    std::vector<char> symbols;
+    huffman::detail::mtf_encode(transformed.data(), transformed.data() + transformed.size(),
+                                symbols);
+    std::string mtf(s.size(), 0), decoded(s.size(), 0);
+    huffman::detail::mtf_decode(symbols.data(), symbols.data() + symbols.size(), mtf.data(),
+                                mtf.data() + mtf.size());
+    EXPECT_EQ(mtf, transformed);
+    huffman::detail::bwt_inverse(mtf.data(), mtf.data() + mtf.size(), primary,
+                                 decoded.data());
+    EXPECT_EQ(decoded, s);
+  }
+  std::string banana(6, 0);
+  EXPECT_EQ(huffman::detail::bwt_forward("banana", "banana" + 6, banana.data()), 4u);
+  EXPECT_EQ(banana, "annbaa");
+}
+
+TEST(bwt, corrupted_block) {
+  huffman::encode_options options;
+  options.bwt = true;
+  std::string s = repetitive_string(100'000);
+  std::string encoded = encode_blocks(s, options);
+  // first block type follows magic, version and flags
+  ASSERT_EQ(encoded[6], 6);
+  std::string corrupted = encoded;
+  // row of the block beyond its size
+  corrupted[6 + 9 + 3] = 0x7F;
+  EXPECT_THROW(decode_string(corrupted), std::invalid_argument);
+  corrupted = encoded;
+  // more symbols than a block can have
+  corrupted[6 + 9 + 7] = 0x7F;
+  EXPECT_THROW(decode_string(corrupted), std::invalid_argument);
+}
+
+TEST(table_cache, repeated_lengths) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  // 10 distinct tables, more than are kept, each one repeated
+  std::string s;
+  for (size_t i = 0; i < 20; i++) {
+    s += random_string(options.block_size, 'a', static_cast<char>('b' + i % 10),
+                       static_cast<unsigned>(i));
+  }
+  for (size_t i = 0; i < 4; i++) {
+    s += random_string(options.block_size, 'a', 'p', static_cast<unsigned>(i));
+  }
+  std::string encoded = encode_blocks(s, options);
+  huffman::stats stats;
+  huffman::decode_options decode_options;
+  decode_options.stats = &stats;
+  EXPECT_EQ(decode_string(encoded, decode_options), s);
+  // the last blocks share a table, the others get evicted before repeating
+  EXPECT_EQ(stats.reused_tables, 3u);
+
+  // tables of other lookup sizes aren't shared
+  decode_options.table_bits = huffman::MIN_TABLE_BITS;
+  EXPECT_EQ(decode_string(encoded, decode_options), s);
+  EXPECT_EQ(stats.reused_tables, 6u);
+
+  // single table streams reuse tables across calls
+  std::string small = random_string(1000, 'a', 'z');
+  std::stringstream src(small), single;
+  huffman::encode(src, single);
+  stats = {};
+  for (size_t i = 0; i < 3; i++) {
+    EXPECT_EQ(decode_string(single.str(), decode_options), small);
+  }
+  EXPECT_EQ(stats.reused_tables, 2u);
+}
+
+namespace {
+// stream input is decoded sequentially, only buffers take the speculative path
+std::string decode_single_buffer(std::string const& encoded,
+                                 huffman::decode_options const& options) {
+  std::vector<uint8_t> decoded;
+  huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(), decoded,
+                  options);
+  return std::string(decoded.begin(), decoded.end());
+}
+} // namespace
+
+TEST(speculative, same_as_sequential) {
+  std::string text = join(json_messages(150'000));
+  // codes of one and two chars are a single 1-bit code and a complete one
+  for (std::string const& s :
+       {text, skewed_string(20) + text, random_string(5'000'000, 'a', 'c'),
+        random_string(7'000'000, 'a', 't'),
+        random_string(5'000'000, std::numeric_limits<char>::min(),
+                      std::numeric_limits<char>::max()),
+        std::string(30'000'000, 'x'), random_string(6'000'000, 'a', 'b')}) {
+    std::string encoded = encode_single(s);
+    std::string sequential = decode_single_buffer(encoded, {});
+    EXPECT_EQ(sequential, s);
+    for (size_t threads : {2, 3, 8}) {
+      huffman::decode_options options;
+      options.threads = threads;
+      huffman::stats stats;
+      options.stats = &stats;
+      EXPECT_EQ(decode_single_buffer(encoded, options), sequential);
+      EXPECT_EQ(stats.bytes_out, s.size());
+      EXPECT_GE(stats.coded_chars, s.size());
+    }
+  }
+}
+
+TEST(speculative, bad_input) {
+  std::string s = join(json_messages(150'000));
+  std::string encoded = encode_single(s);
+  huffman::decode_options options;
+  options.threads = 4;
+  std::vector<uint8_t> dst(s.size() - 1);
+  EXPECT_THROW(huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()),
+                               encoded.size(), dst.data(), dst.size(), options),
+               std::invalid_argument);
+  // more bits ignored than the last code leaves
+  std::string corrupted = encoded;
+  corrupted[256] = 8;
+  EXPECT_THROW(decode_single_buffer(corrupted, options), std::invalid_argument);
+}
+
+namespace {
+std::vector<huffman::buffer> to_buffers(std::vector<std::string> const& messages) {
+  std::vector<huffman::buffer> inputs;
+  for (std::string const& m : messages) {
+    inputs.push_back({reinterpret_cast<uint8_t const*>(m.data()), m.size()});
+  }
+  return inputs;
+}
+} // namespace
+
+TEST(batch, same_as_encode) {
+  std::vector<std::string> messages = json_messages(500);
+  messages.insert(messages.begin() + 7, std::string());
+  messages.push_back(random_string(300'000, 'a', 'z'));
+  std::vector<huffman::buffer> inputs = to_buffers(messages);
+  huffman::batch_output out{{1, 2, 3}, {4}};
+  for (size_t threads : {1, 3, 8}) {
+    huffman::encode_options options;
+    options.threads = threads;
+    options.checksums = true;
+    huffman::stats stats;
+    options.stats = &stats;
+    huffman::encode_batch(inputs.data(), inputs.size(), out, options);
+    ASSERT_EQ(out.offsets.size(), messages.size() + 1);
+    EXPECT_EQ(out.offsets.front(), 0);
+    EXPECT_EQ(out.offsets.back(), out.data.size());
+    for (size_t i = 0; i < messages.size(); i++) {
+      std::vector<uint8_t> expected;
+      huffman::encode(inputs[i].data, inputs[i].size, expected, options);
+      EXPECT_TRUE(std::equal(out.data.begin() + out.offsets[i],
+                             out.data.begin() + out.offsets[i + 1], expected.begin(),
+                             expected.end()));
+    }
+    EXPECT_EQ(stats.bytes_out, 2 * out.data.size());
+  }
+  huffman::encode_batch(inputs.data(), 0, out);
+  EXPECT_TRUE(out.data.empty());
+  EXPECT_EQ(out.offsets, std::vector<size_t>{0});
+}
+
+TEST(batch, shared_model) {
+  std::vector<std::string> messages = json_messages(400);
+  std::string samples = join(messages);
+  huffman::model m = huffman::model::train(reinterpret_cast<uint8_t const*>(samples.data()),
+                                           samples.size());
+  std::vector<huffman::buffer> inputs = to_buffers(messages);
+  for (size_t threads : {1, 4}) {
+    huffman::batch_output out;
+    m.encode_batch(inputs.data(), inputs.size(), out, threads);
+    ASSERT_EQ(out.offsets.size(), messages.size() + 1);
+    for (size_t i = 0; i < messages.size(); i++) {
+      std::vector<uint8_t> decoded;
+      m.decode(out.data.data() + out.offsets[i], out.offsets[i + 1] - out.offsets[i],
+               decoded);
+      EXPECT_EQ(decoded, to_bytes(messages[i]));
+    }
+  }
+}
+
+TEST(batch, bad_options) {
+  std::vector<std::string> messages = json_messages(3);
+  std::vector<huffman::buffer> inputs = to_buffers(messages);
+  huffman::encode_options options;
+  options.block_size = 1;
+  huffman::batch_output out;
+  EXPECT_THROW(huffman::encode_batch(inputs.data(), inputs.size(), out, options),
+               std::invalid_argument);
+}
+
+namespace {
+// heap allocations of the test process so far
+std::atomic<size_t> allocations{0};
+} // namespace
+
+// every form of new and delete is replaced, so that whatever form the
+// standard library picks, memory is taken and given back by malloc and free
+namespace {
+void* counted_alloc(size_t size, size_t alignment = alignof(std::max_align_t)) {
+  allocations++;
+  size = size == 0 ? 1 : size;
+  if (alignment <= alignof(std::max_align_t)) {
+    return std::malloc(size);
+  }
+  // aligned_alloc takes sizes of whole alignments
+  return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void* counted_alloc_or_throw(size_t size, size_t alignment = alignof(std::max_align_t)) {
+  if (void* p = counted_alloc(size, alignment)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+} // namespace
+
+void* operator new(size_t size) {
+  return counted_alloc_or_throw(size);
+}
+
+void* operator new[](size_t size) {
+  return counted_alloc_or_throw(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+  return counted_alloc_or_throw(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return counted_alloc_or_throw(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, std::nothrow_t const&) noexcept {
+  return counted_alloc(size);
+}
+
+void* operator new[](size_t size, std::nothrow_t const&) noexcept {
+  return counted_alloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept {
+  return counted_alloc(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept {
+  return counted_alloc(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::nothrow_t const&) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::nothrow_t const&) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t, std::nothrow_t const&) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, std::nothrow_t const&) noexcept {
+  std::free(p);
+}
+
+TEST(context, no_allocations) {
+  std::string text = join(json_messages(2000));
+  // options, and whether their encode and decode may allocate, as huffman.h
+  // says of huffman::context
+  struct calls {
+    huffman::encode_options options;
+    bool encode_allocates;
+    bool decode_allocates;
+  };
+  std::vector<calls> all_calls(7);
+  all_calls[1].options.interleaved = true;
+  all_calls[2].options.checksums = true;
+  all_calls[2].options.index = true;
+  all_calls[3].options.block_size = huffman::MIN_BLOCK_SIZE;
+  all_calls[4].options.order1 = true;
+  all_calls[4].encode_allocates = true;
+  all_calls[5].options.adaptive = true;
+  all_calls[5].encode_allocates = true;
+  all_calls[6].options.bwt = true;
+  all_calls[6].encode_allocates = true;
+  all_calls[6].decode_allocates = true;
+  // run and raw blocks, and chars whose codes are longer than the table
+  std::vector<std::string> inputs{text, std::string(100'000, 'x'),
+                                  random_string(100'000, std::numeric_limits<char>::min(),
+                                                std::numeric_limits<char>::max()),
+                                  skewed_string() + text};
+  huffman::context ctx;
+  huffman::decode_options decode_options;
+  decode_options.context = &ctx;
+  for (calls& c : all_calls) {
+    huffman::encode_options& options = c.options;
+    options.context = &ctx;
+    for (std::string const& s : inputs) {
+      std::vector<uint8_t> encoded(huffman::max_compressed_size(s.size(), options));
+      std::vector<uint8_t> decoded(s.size());
+      // the first calls fill the context
+      size_t n = huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(),
+                                 encoded.data(), encoded.size(), options);
+      huffman::decode(encoded.data(), n, decoded.data(), decoded.size(), decode_options);
+      size_t before = allocations;
+      huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(), encoded.data(),
+                      encoded.size(), options);
+      if (!c.encode_allocates) {
+        EXPECT_EQ(allocations - before, 0);
+      }
+      before = allocations;
+      EXPECT_EQ(huffman::decode(encoded.data(), n, decoded.data(), decoded.size(),
+                                decode_options),
+                s.size());
+      if (!c.decode_allocates) {
+        EXPECT_EQ(allocations - before, 0);
+      }
+      EXPECT_EQ(decoded, to_bytes(s));
+    }
+  }
+
+  // single table format
+  std::string encoded = encode_single(text);
+  std::vector<uint8_t> decoded(text.size());
+  huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(),
+                  decoded.data(), decoded.size(), decode_options);
+  size_t before = allocations;
+  huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(),
+                  decoded.data(), decoded.size(), decode_options);
+  EXPECT_EQ(allocations - before, 0);
+}
+
+TEST(context, tables_reused_in_place) {
+  // more distinct tables than the cache keeps, so they are evicted and built
+  // again in the memory of others
+  std::vector<std::string> streams;
+  for (size_t i = 0; i < 12; i++) {
+    streams.push_back(encode_blocks(random_string(5000, 'a', static_cast<char>('c' + i))));
+  }
+  huffman::context ctx;
+  huffman::decode_options options;
+  options.context = &ctx;
+  auto decode_stream = [&options](std::string const& data) {
+    std::vector<uint8_t> decoded;
+    huffman::decode(reinterpret_cast<uint8_t const*>(data.data()), data.size(), decoded,
+                    options);
+    return decoded;
+  };
+  for (size_t round = 0; round < 3; round++) {
+    for (size_t i = 0; i < streams.size(); i++) {
+      EXPECT_EQ(decode_stream(streams[i]),
+                to_bytes(random_string(5000, 'a', static_cast<char>('c' + i))));
+    }
+  }
+  huffman::context moved = std::move(ctx);
+  options.context = &moved;
+  EXPECT_EQ(decode_stream(streams[0]), to_bytes(random_string(5000, 'a', 'c')));
+}
+
+namespace {
+std::string encode_buffer(std::string const& data, huffman::encode_options const& options) {
+  std::vector<uint8_t> encoded;
+  huffman::encode(reinterpret_cast<uint8_t const*>(data.data()), data.size(), encoded, options);
+  return std::string(encoded.begin(), encoded.end());
+}
+
+uint32_t read_le32(std::string const& s, size_t offset) {
+  uint32_t val = 0;
+  for (size_t i = 0; i < 4; i++) {
+    val |= static_cast<uint32_t>(static_cast<unsigned char>(s[offset + i])) << (8 * i);
+  }
+  return val;
+}
+} // namespace
+
+TEST(sampled_counts, round_trip) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  std::string s = random_string(5 * options.block_size, 'a', 'p') +
+                  random_string(3 * options.block_size + 1000, 'a', 'z');
+  size_t exact = encode_buffer(s, options).size();
+  for (bool interleaved : {false, true}) {
+    for (bool random_sampling : {false, true}) {
+      for (double fraction : {0.01, 0.2, 0.7, 1.0}) {
+        options.interleaved = interleaved;
+        options.random_sampling = random_sampling;
+        options.sample_fraction = fraction;
+        options.threads = 1;
+        std::string encoded = encode_buffer(s, options);
+        EXPECT_EQ(decode_string(encoded), s);
+        // codes of chars missing from the sample take space from the others,
+        // which costs the most on small alphabets like this one
+        EXPECT_LE(encoded.size(), 1.06 * exact);
+        // every API writes the same blocks
+        EXPECT_EQ(encode_blocks(s, options), encoded);
+        options.threads = 4;
+        EXPECT_EQ(encode_buffer(s, options), encoded);
+        std::vector<uint8_t> fixed(huffman::max_compressed_size(s.size(), options));
+        fixed.resize(huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(),
+                                     fixed.data(), fixed.size(), options));
+        EXPECT_EQ(fixed, to_bytes(encoded));
+        huffman::encoder encoder(options);
+        std::vector<uint8_t> incremental;
+        encoder.feed(reinterpret_cast<uint8_t const*>(s.data()), s.size(), incremental);
+        encoder.finish(incremental);
+        EXPECT_EQ(incremental, to_bytes(encoded));
+      }
+    }
+  }
+}
+
+TEST(sampled_counts, chars_missing_from_sample) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  options.sample_fraction = 0.125;
+  options.checksums = true;
+  // pieces at the starts of both halves have only a few chars, the rest of
+  // the block has all of them
+  std::string s = random_string(options.block_size, 'a', 'f');
+  std::string const rare("\x00\xff\x80xyz", 6);
+  for (size_t i = 5000; i < 30000; i += 97) {
+    s[i] = rare[i % rare.size()];
+  }
+  std::string encoded = encode_buffer(s, options);
+  EXPECT_EQ(encoded[6], 1);
+  EXPECT_EQ(decode_string(encoded), s);
+  EXPECT_LT(encoded.size(), s.size() / 2);
+}
+
+TEST(sampled_counts, falls_back_to_raw) {
+  huffman::encode_options options;
+  options.block_size = huffman::MIN_BLOCK_SIZE;
+  options.sample_fraction = 0.125;
+  options.index = true;
+  // samples look like 2 chars, but the rest are random bytes, whose codes
+  // are longer than 8 bits
+  std::string s = random_string(options.block_size, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max());
+  for (size_t piece : {size_t{0}, options.block_size / 2}) {
+    std::copy_n(random_string(4096, 'a', 'b').begin(), 4096, s.begin() + piece);
+  }
+  s += std::string(options.block_size, 'x');
+  for (size_t threads : {1, 4}) {
+    options.threads = threads;
+    std::string encoded = encode_buffer(s, options);
+    EXPECT_EQ(encoded[6], 3);
+    EXPECT_EQ(encoded[6 + 9 + options.block_size], 4);
+    EXPECT_EQ(decode_string(encoded), s);
+    std::vector<uint8_t> range;
+    huffman::decode_range(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(),
+                          options.block_size - 10, 20, range);
+    EXPECT_EQ(range, to_bytes(s.substr(options.block_size - 10, 20)));
+  }
+}
+
+TEST(sampled_counts, bad_fraction) {
+  huffman::encode_options options;
+  for (double fraction : {0.0, -0.5, 1.5, std::nan("")}) {
+    options.sample_fraction = fraction;
+    EXPECT_THROW(encode_blocks("abc", options), std::invalid_argument);
+  }
+}
+
+TEST(adaptive, splits_where_data_changes) {
+  constexpr size_t piece = 16 << 10;
+  std::string s = random_string(12 * piece, 'a', 'f') +
+                  random_string(20 * piece, std::numeric_limits<char>::min(),
+                                std::numeric_limits<char>::max()) +
+                  random_string(10 * piece + 100, 'x', 'z');
+  huffman::encode_options options;
+  options.block_size = size_t{4} << 20;
+  std::string fixed = encode_buffer(s, options);
+  options.adaptive = true;
+  huffman::stats stats;
+  options.stats = &stats;
+  std::string encoded = encode_buffer(s, options);
+  EXPECT_EQ(stats.blocks, 3u);
+  EXPECT_EQ(decode_string(encoded), s);
+  EXPECT_LT(encoded.size(), 0.9 * fixed.size());
+  // the second block is raw and starts right after the first
+  size_t second = 6 + 9 + read_le32(encoded, 6 + 5);
+  EXPECT_EQ(encoded[second], 3);
+  EXPECT_EQ(read_le32(encoded, second + 1), 20 * piece);
+}
+
+TEST(adaptive, stable_data_in_one_block) {
+  huffman::encode_options options;
+  options.adaptive = true;
+  huffman::stats stats;
+  options.stats = &stats;
+  std::string s = random_string(options.block_size, 'a', 'p');
+  std::string encoded = encode_buffer(s, options);
+  EXPECT_EQ(stats.blocks, 1u);
+  options.adaptive = false;
+  EXPECT_EQ(encode_buffer(s, options), encoded);
+}
+
+TEST(adaptive, fits_max_compressed_size) {
+  // every piece biased a bit toward low or toward high bytes, by turns, is
+  // a block of its own, yet stored raw
+  constexpr size_t piece = 16 << 10;
+  std::string s;
+  for (size_t i = 0; i < 128; i++) {
+    std::string biased = random_string(piece, std::numeric_limits<char>::min(),
+                                       std::numeric_limits<char>::max(), i);
+    std::string half = i % 2 ? random_string(piece / 4, 0, 127, i)
+                             : random_string(piece / 4, std::numeric_limits<char>::min(), -1, i);
+    for (size_t j = 0; j < half.size(); j++) {
+      biased[4 * j] = half[j];
+    }
+    s += biased;
+  }
+  huffman::encode_options options;
+  options.adaptive = true;
+  options.checksums = true;
+  options.index = true;
+  for (size_t block_size : {size_t{1} << 20, size_t{100'000}}) {
+    options.block_size = block_size;
+    for (size_t threads : {1, 4}) {
+      options.threads = threads;
+      huffman::stats stats;
+      options.stats = &stats;
+      std::vector<uint8_t> encoded(huffman::max_compressed_size(s.size(), options));
+      size_t written = huffman::encode(reinterpret_cast<uint8_t const*>(s.data()), s.size(),
+                                       encoded.data(), encoded.size(), options);
+      // pieces aligned with the biased ones make the bound tight
+      if (block_size % piece == 0) {
+        EXPECT_EQ(written, encoded.size());
+      }
+      encoded.resize(written);
+      EXPECT_GT(stats.blocks, s.size() / block_size + 1);
+      EXPECT_EQ(stats.coded_chars, 0u);
+      EXPECT_EQ(decode_string(std::string(encoded.begin(), encoded.end())), s);
+    }
+  }
+}
+
+TEST(adaptive, same_as_buffer) {
+  huffman::encode_options options;
+  options.block_size = size_t{256} << 10;
+  options.adaptive = true;
+  options.index = true;
+  std::string s;
+  for (size_t i = 0; i < 12; i++) {
+    s += random_string((i + 3) * 10'000, static_cast<char>('a' + 4 * (i % 3)),
+                       static_cast<char>('d' + 9 * (i % 3)), static_cast<unsigned>(i));
+  }
+  for (bool interleaved : {false, true}) {
+    options.interleaved = interleaved;
+    options.threads = 1;
+    std::string encoded = encode_buffer(s, options);
+    EXPECT_EQ(decode_string(encoded), s);
+    EXPECT_EQ(encode_blocks(s, options), encoded);
+    huffman::encoder encoder(options);
+    std::vector<uint8_t> incremental;
+    encoder.feed(reinterpret_cast<uint8_t const*>(s.data()), s.size(), incremental);
+    encoder.finish(incremental);
+    EXPECT_EQ(incremental, to_bytes(encoded));
+    options.threads = 4;
+    EXPECT_EQ(encode_buffer(s, options), encoded);
+    std::vector<uint8_t> range;
+    huffman::decode_range(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(),
+                          100'000, 50'000, range);
+    EXPECT_EQ(range, to_bytes(s.substr(100'000, 50'000)));
+  }
+}
+
+namespace {
+// single table format input of the given code lengths and message bytes
+std::string single_table(std::array<uint8_t, 256> const& lengths, uint8_t ignore_bits,
+                         std::string const& message) {
+  return std::string(lengths.begin(), lengths.end()) + static_cast<char>(ignore_bits) + message;
+}
+} // namespace
+
+TEST(validated_tables, longest_code_lengths) {
+  // complete code of lengths 1 to 54 and two of 55, the longest a refill holds
+  std::array<uint8_t, 256> lengths{};
+  for (size_t i = 0; i < 54; i++) {
+    lengths[i] = static_cast<uint8_t>(i + 1);
+  }
+  lengths[54] = lengths[55] = 55;
+  // code 0, then 55 ones
+  std::string message = "\x7F" + std::string(6, '\xFF');
+  for (size_t table_bits : {huffman::MIN_TABLE_BITS, huffman::MAX_TABLE_BITS}) {
+    huffman::decode_options options;
+    options.table_bits = table_bits;
+    EXPECT_EQ(decode_string(single_table(lengths, 0, message), options), "\x80\xB7");
+  }
+  // the same with a code of 56 bits
+  lengths[53] = 54;
+  lengths[54] = 55;
+  lengths[55] = lengths[56] = 56;
+  EXPECT_THROW(decode_string(single_table(lengths, 0, message)), std::invalid_argument);
+  lengths[56] = 255;
+  EXPECT_THROW(decode_string(single_table(lengths, 0, message)), std::invalid_argument);
+}
+
+TEST(validated_tables, incomplete_code) {
+  // a single code leaves half of the table empty, bits there have no char
+  std::array<uint8_t, 256> lengths{};
+  lengths['a' - std::numeric_limits<char>::min()] = 1;
+  std::string zeros(100, '\0');
+  for (size_t table_bits : {huffman::MIN_TABLE_BITS, huffman::MAX_TABLE_BITS}) {
+    huffman::decode_options options;
+    options.table_bits = table_bits;
+    EXPECT_EQ(decode_string(single_table(lengths, 0, zeros), options), std::string(800, 'a'));
+    std::vector<uint8_t> decoded;
+    std::string encoded = single_table(lengths, 0, zeros + '\x01' + zeros);
+    EXPECT_THROW(huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()),
+                                 encoded.size(), decoded, options),
+                 std::invalid_argument);
+  }
+}
+
+TEST(validated_tables, incomplete_code_on_threads) {
+  // a single code of 1 bit, whose table entries take 2 bits for paired chars
+  std::string s(size_t{20} << 20, 'a');
+  std::string encoded = encode_single(s);
+  for (size_t table_bits : {huffman::MIN_TABLE_BITS, huffman::MAX_TABLE_BITS}) {
+    huffman::decode_options options;
+    options.table_bits = table_bits;
+    options.threads = 4;
+    std::vector<uint8_t> decoded;
+    huffman::decode(reinterpret_cast<uint8_t const*>(encoded.data()), encoded.size(), decoded,
+                    options);
+    EXPECT_EQ(decoded.size(), s.size());
+    EXPECT_EQ(decoded, to_bytes(s));
+  }
+}